@@ -0,0 +1,42 @@
+/*
+ * affinity.c - pin threads to cores.
+ *
+ * With several listening sockets (-l), each accept thread or event loop
+ * is kept on a core of its own, so a connection the kernel hands to a
+ * listener is accepted and served where its packets already are.
+ * This file stays apart from the others because the CPU set macros
+ * need _GNU_SOURCE, under which netdb.h declares a gai_error that
+ * clashes with the one of csapp.h.
+ */
+#define _GNU_SOURCE
+#include <pthread.h>
+#include <sched.h>
+#include "affinity.h"
+
+/*
+ * affinity_pin: run the calling thread on the i-th of the cores it may
+ *               use, modulo their number. Only a hint: if it fails, the
+ *               thread keeps running wherever the scheduler puts it.
+ */
+void affinity_pin(int i)
+{
+    cpu_set_t allowed, set;
+    int cpu, n;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0
+        || (n = CPU_COUNT(&allowed)) == 0)
+    {
+        return;
+    }
+    i %= n;
+    for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed) && i-- == 0)
+        {
+            break;
+        }
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
@@ -0,0 +1,6 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+
+void affinity_pin(int i);
+
+#endif
@@ -0,0 +1,52 @@
+#!/bin/sh
+#
+# bench.sh - benchmark each proxy mode against the origin stub
+#
+# Starts bench/origin, then for each mode starts the proxy, replays a
+# Zipf workload through it with bench/loadgen and prints what loadgen
+# measured. Settings come from the environment:
+#
+#   DURATION  seconds per mode (10)       CONNS     client connections (32)
+#   OBJECTS   distinct objects (2000)     ALPHA     Zipf exponent (0.99)
+#   MIN_SIZE  smallest object (1024)      MAX_SIZE  largest object (65536)
+#   LATENCY   origin delay in ms (5)      JITTER    extra random delay (5)
+#   MODES     proxy arguments per mode, separated by ";"
+#   PROXY_PORT, ORIGIN_PORT
+#
+cd "$(dirname "$0")/.." || exit 1
+
+DURATION=${DURATION:-10}
+CONNS=${CONNS:-32}
+OBJECTS=${OBJECTS:-2000}
+ALPHA=${ALPHA:-0.99}
+MIN_SIZE=${MIN_SIZE:-1024}
+MAX_SIZE=${MAX_SIZE:-65536}
+LATENCY=${LATENCY:-5}
+JITTER=${JITTER:-5}
+MODES=${MODES:-"-q;-q -e 4"}
+PROXY_PORT=${PROXY_PORT:-15313}
+ORIGIN_PORT=${ORIGIN_PORT:-18090}
+
+./bench/origin -s "$MIN_SIZE" -S "$MAX_SIZE" -l "$LATENCY" -j "$JITTER" \
+    "$ORIGIN_PORT" &
+origin_pid=$!
+trap 'kill $origin_pid $proxy_pid 2>/dev/null' EXIT INT TERM
+sleep 0.5
+
+echo "$OBJECTS objects of $MIN_SIZE-$MAX_SIZE bytes, Zipf $ALPHA," \
+     "$CONNS connections, origin delay ${LATENCY}+${JITTER} ms"
+IFS=';'
+for mode in $MODES
+do
+    unset IFS
+    echo
+    echo "== proxy $mode"
+    ./proxy $mode "$PROXY_PORT" > /dev/null &
+    proxy_pid=$!
+    sleep 0.5
+    ./bench/loadgen -c "$CONNS" -d "$DURATION" -u "$OBJECTS" -z "$ALPHA" \
+        -o "localhost:$ORIGIN_PORT" localhost "$PROXY_PORT"
+    kill $proxy_pid 2>/dev/null
+    wait $proxy_pid 2>/dev/null
+    IFS=';'
+done
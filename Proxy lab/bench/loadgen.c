@@ -0,0 +1,363 @@
+/*
+ * loadgen.c - load generator for benchmarking the proxy.
+ *
+ * Each of -c threads keeps a connection to the proxy and sends GET
+ * requests for /obj/<n> of the origin stub back to back, reconnecting
+ * whenever the proxy closes, for -d seconds. Object numbers follow a
+ * Zipf distribution over -u objects with exponent -z, so a few objects
+ * are very popular and most are rarely asked for, as on the web.
+ *
+ * At the end it prints the request rate, latency percentiles from a
+ * log-linear histogram, and the hit ratio: the requests the origin did
+ * not see, from its /__count before and after the run.
+ *
+ * usage: loadgen [-c <conns>] [-d <secs>] [-u <objects>] [-z <alpha>]
+ *                [-o <origin host:port>] <proxy host> <proxy port>
+ */
+#include "csapp.h"
+#include <math.h>
+
+#define SUB_BITS 3        /* Histogram buckets per power of two */
+#define BUCKETS  256
+#define HOST_MAX 256      /* Longest origin host:port */
+
+/* Struct for what one thread measured */
+typedef struct worker worker;
+struct worker
+{
+    pthread_t tid;
+    unsigned seed;
+    long requests;
+    long errors;
+    long bytes;
+    long count[BUCKETS];  /* Latencies in microseconds */
+};
+
+static char *proxy_host, *proxy_port;
+static char origin[HOST_MAX] = "localhost:18090";
+static int duration = 10;
+static long universe = 1000;
+static double alpha = 0.99;
+
+static double *cdf;       /* Zipf CDF over object numbers */
+static long deadline;     /* In microseconds */
+
+/* now_us: a monotonic clock in microseconds */
+static long now_us()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* bucket_of: histogram bucket for us microseconds, as in metrics.c */
+static int bucket_of(unsigned long us)
+{
+    int e, b;
+
+    if (us < (1 << SUB_BITS))
+    {
+        return us;
+    }
+    e = 63 - __builtin_clzl(us);
+    b = ((e - SUB_BITS + 1) << SUB_BITS)
+        | ((us >> (e - SUB_BITS)) & ((1 << SUB_BITS) - 1));
+    return b < BUCKETS ? b : BUCKETS - 1;
+}
+
+/* bucket_top: the first value above bucket b, in microseconds */
+static long bucket_top(int b)
+{
+    int g = b >> SUB_BITS, s = b & ((1 << SUB_BITS) - 1);
+
+    if (g == 0)
+    {
+        return s + 1;
+    }
+    return ((1L << SUB_BITS) + s + 1) << (g - 1);
+}
+
+/* zipf_init: CDF of P(n) proportional to 1 / (n + 1)^alpha */
+static void zipf_init()
+{
+    double sum = 0;
+    long n;
+
+    cdf = Malloc(universe * sizeof(double));
+    for (n = 0; n < universe; n++)
+    {
+        sum += 1.0 / pow(n + 1, alpha);
+        cdf[n] = sum;
+    }
+    for (n = 0; n < universe; n++)
+    {
+        cdf[n] /= sum;
+    }
+}
+
+/* zipf_next: draw an object number */
+static long zipf_next(unsigned *seed)
+{
+    double u = (double)rand_r(seed) / ((double)RAND_MAX + 1);
+    long lo = 0, hi = universe - 1, mid;
+
+    while (lo < hi)
+    {
+        mid = (lo + hi) / 2;
+        if (cdf[mid] < u)
+        {
+            lo = mid + 1;
+        }
+        else
+        {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/*
+ * fetch: send one request on fd and read the whole response. Return
+ *        the body length, -1 on an error, and clear *keep if the
+ *        connection cannot be used again.
+ */
+static long fetch(int fd, rio_t *rio, const char *path, int *keep)
+{
+    char buf[MAXLINE];
+    long len = -1, got = 0, n;
+    int status = 0;
+
+    snprintf(buf, sizeof(buf),
+             "GET http://%s%s HTTP/1.1\r\nHost: %s\r\n\r\n",
+             origin, path, origin);
+    if (rio_writen(fd, buf, strlen(buf)) < 0
+        || rio_readlineb(rio, buf, MAXLINE) <= 0
+        || sscanf(buf, "HTTP/%*d.%*d %d", &status) != 1)
+    {
+        return -1;
+    }
+    *keep = 1;
+    while ((n = rio_readlineb(rio, buf, MAXLINE)) > 0
+           && strcmp(buf, "\r\n") && strcmp(buf, "\n"))
+    {
+        if (!strncasecmp(buf, "Content-Length:", 15))
+        {
+            len = atol(buf + 15);
+        }
+        else if (!strncasecmp(buf, "Connection:", 11)
+                 && (strstr(buf, "close") || strstr(buf, "Close")))
+        {
+            *keep = 0;
+        }
+    }
+    if (n <= 0)
+    {
+        return -1;
+    }
+    /* Without a length the body ends when the proxy closes */
+    if (len < 0)
+    {
+        *keep = 0;
+    }
+    while (len < 0 || got < len)
+    {
+        n = rio_readnb(rio, buf, len < 0 || len - got > MAXLINE
+                                 ? MAXLINE : len - got);
+        if (n <= 0)
+        {
+            break;
+        }
+        got += n;
+    }
+    if ((len >= 0 && got < len) || status != 200)
+    {
+        return -1;
+    }
+    return got;
+}
+
+/* worker_thread: request objects until the deadline */
+static void *worker_thread(void *vargp)
+{
+    worker *w = vargp;
+    char path[64];
+    int fd = -1, keep = 0;
+    long start, n;
+    rio_t rio;
+
+    while ((start = now_us()) < deadline)
+    {
+        if (fd < 0)
+        {
+            if ((fd = open_clientfd(proxy_host, proxy_port)) < 0)
+            {
+                w->errors++;
+                usleep(10000);
+                continue;
+            }
+            Rio_readinitb(&rio, fd);
+        }
+        snprintf(path, sizeof(path), "/obj/%ld", zipf_next(&w->seed));
+        n = fetch(fd, &rio, path, &keep);
+        if (n < 0)
+        {
+            w->errors++;
+            keep = 0;
+        }
+        else
+        {
+            w->requests++;
+            w->bytes += n;
+            w->count[bucket_of(now_us() - start)]++;
+        }
+        if (!keep)
+        {
+            Close(fd);
+            fd = -1;
+        }
+    }
+    if (fd >= 0)
+    {
+        Close(fd);
+    }
+    return NULL;
+}
+
+/* origin_count: objects the origin has served, -1 if it cannot tell */
+static long origin_count()
+{
+    char host[HOST_MAX], *port, buf[MAXLINE];
+    long count = -1;
+    rio_t rio;
+    int fd;
+
+    strcpy(host, origin);
+    if ((port = strrchr(host, ':')) == NULL)
+    {
+        return -1;
+    }
+    *port++ = '\0';
+    if ((fd = open_clientfd(host, port)) < 0)
+    {
+        return -1;
+    }
+    snprintf(buf, sizeof(buf), "GET /__count HTTP/1.0\r\n\r\n");
+    Rio_readinitb(&rio, fd);
+    if (rio_writen(fd, buf, strlen(buf)) > 0)
+    {
+        while (rio_readlineb(&rio, buf, MAXLINE) > 0
+               && strcmp(buf, "\r\n") && strcmp(buf, "\n"))
+        {
+            ;
+        }
+        if (rio_readlineb(&rio, buf, MAXLINE) > 0)
+        {
+            count = atol(buf);
+        }
+    }
+    Close(fd);
+    return count;
+}
+
+/* percentile: upper bound of the bucket holding quantile q, in us */
+static long percentile(long *count, long total, double q)
+{
+    long seen = 0, rank = (long)(q * total + 0.5);
+    int b;
+
+    for (b = 0; b < BUCKETS; b++)
+    {
+        seen += count[b];
+        if (seen >= rank && seen > 0)
+        {
+            return bucket_top(b);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    int opt, conns = 8, i, b, bad = 0;
+    long before, after, requests = 0, errors = 0, bytes = 0;
+    long count[BUCKETS];
+    long start, elapsed;
+    worker *w;
+
+    while ((opt = getopt(argc, argv, "c:d:u:z:o:")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            conns = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'u':
+            universe = atol(optarg);
+            break;
+        case 'z':
+            alpha = atof(optarg);
+            break;
+        case 'o':
+            strncpy(origin, optarg, HOST_MAX - 1);
+            break;
+        default:
+            bad = 1;
+            break;
+        }
+    }
+    if (bad || optind != argc - 2 || conns < 1 || universe < 1)
+    {
+        fprintf(stderr, "usage: %s [-c <conns>] [-d <secs>] [-u <objects>] "
+                "[-z <alpha>] [-o <origin host:port>] <proxy host> "
+                "<proxy port>\n", argv[0]);
+        exit(1);
+    }
+    proxy_host = argv[optind];
+    proxy_port = argv[optind + 1];
+
+    Signal(SIGPIPE, SIG_IGN);
+    zipf_init();
+    before = origin_count();
+    w = Calloc(conns, sizeof(worker));
+    start = now_us();
+    deadline = start + duration * 1000000L;
+    for (i = 0; i < conns; i++)
+    {
+        w[i].seed = 15213 + i;
+        Pthread_create(&w[i].tid, NULL, worker_thread, &w[i]);
+    }
+    memset(count, 0, sizeof(count));
+    for (i = 0; i < conns; i++)
+    {
+        Pthread_join(w[i].tid, NULL);
+        requests += w[i].requests;
+        errors += w[i].errors;
+        bytes += w[i].bytes;
+        for (b = 0; b < BUCKETS; b++)
+        {
+            count[b] += w[i].count[b];
+        }
+    }
+    elapsed = now_us() - start;
+    after = origin_count();
+
+    printf("requests %ld, errors %ld, %.0f req/s, %.1f MB/s\n", requests,
+           errors, requests * 1e6 / elapsed, bytes / (double)elapsed);
+    printf("latency p50 %.3f ms, p99 %.3f ms, p999 %.3f ms\n",
+           percentile(count, requests, 0.5) / 1e3,
+           percentile(count, requests, 0.99) / 1e3,
+           percentile(count, requests, 0.999) / 1e3);
+    if (before >= 0 && after >= 0 && requests > 0)
+    {
+        printf("hit ratio %.1f%% (%ld origin fetches)\n",
+               100.0 * (requests - (after - before)) / requests,
+               after - before);
+    }
+    Free(w);
+    Free(cdf);
+    return 0;
+}
@@ -0,0 +1,176 @@
+/*
+ * origin.c - origin server stub for benchmarking the proxy.
+ *
+ * Serves GET /obj/<n> with a body of a size fixed for each object,
+ * drawn log-uniformly between -s and -S bytes, so that most objects are
+ * small and a few are large. Every response waits -l milliseconds plus
+ * up to -j more before it is sent, like a distant or busy server would.
+ * Responses are HTTP/1.1 with Content-Length and may be cached for -a
+ * seconds. GET /__count returns how many objects were served so far,
+ * so the load generator can tell how many requests got past the cache.
+ *
+ * usage: origin [-s <min>] [-S <max>] [-l <ms>] [-j <ms>] [-a <secs>]
+ *               <port>
+ */
+#include "csapp.h"
+#include <math.h>
+#include <netinet/tcp.h>
+
+static long min_size = 1024;
+static long max_size = 65536;
+static int latency_ms = 0;
+static int jitter_ms = 0;
+static int max_age = 3600;
+
+static char *body;           /* max_size bytes, every object is a prefix */
+static long served;
+
+/* object_size: size of object n, the same on every request */
+static long object_size(unsigned long n)
+{
+    unsigned h = 2166136261u;
+    double u;
+    int i;
+
+    for (i = 0; i < 8; i++)
+    {
+        h ^= (n >> (8 * i)) & 0xff;
+        h *= 16777619u;
+    }
+    u = (double)h / 4294967296.0;
+    return (long)(min_size * exp(u * log((double)max_size / min_size)));
+}
+
+/* delay: the injected latency of one response */
+static void delay(unsigned *seed)
+{
+    int ms = latency_ms + (jitter_ms > 0 ? rand_r(seed) % (jitter_ms + 1)
+                                         : 0);
+    if (ms > 0)
+    {
+        usleep(ms * 1000);
+    }
+}
+
+/* respond: send one response, return 0 if the connection is gone */
+static int respond(int fd, char *path, int keep_alive, unsigned *seed)
+{
+    char hdr[MAXLINE], count[32];
+    unsigned long n;
+    long size;
+    const char *conn = keep_alive ? "keep-alive" : "close";
+
+    if (!strcmp(path, "/__count"))
+    {
+        size = snprintf(count, sizeof(count), "%ld\n",
+                        __atomic_load_n(&served, __ATOMIC_RELAXED));
+        snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+                 "Content-Length: %ld\r\nCache-Control: no-store\r\n"
+                 "Connection: %s\r\n\r\n%s", size, conn, count);
+        return rio_writen(fd, hdr, strlen(hdr)) > 0;
+    }
+    if (sscanf(path, "/obj/%lu", &n) != 1)
+    {
+        snprintf(hdr, sizeof(hdr), "HTTP/1.1 404 Not Found\r\n"
+                 "Content-Length: 0\r\nConnection: %s\r\n\r\n", conn);
+        return rio_writen(fd, hdr, strlen(hdr)) > 0;
+    }
+
+    delay(seed);
+    size = object_size(n);
+    __atomic_add_fetch(&served, 1, __ATOMIC_RELAXED);
+    snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\n"
+             "Content-Type: application/octet-stream\r\n"
+             "Content-Length: %ld\r\nCache-Control: max-age=%d\r\n"
+             "Connection: %s\r\n\r\n", size, max_age, conn);
+    return rio_writen(fd, hdr, strlen(hdr)) > 0
+           && rio_writen(fd, body, size) == size;
+}
+
+/* conn_thread: serve the requests of one connection in order */
+static void *conn_thread(void *vargp)
+{
+    int fd = *(int *)vargp, on = 1;
+    char buf[MAXLINE], method[MAXLINE], path[MAXLINE], version[MAXLINE];
+    unsigned seed = fd ^ (unsigned)time(NULL);
+    int keep_alive = 1;
+    rio_t rio;
+
+    Pthread_detach(Pthread_self());
+    Free(vargp);
+    /* Header and body go in two writes, do not let Nagle hold the body */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    Rio_readinitb(&rio, fd);
+    while (keep_alive && rio_readlineb(&rio, buf, MAXLINE) > 0)
+    {
+        if (sscanf(buf, "%s %s %s", method, path, version) != 3)
+        {
+            break;
+        }
+        keep_alive = !strcmp(version, "HTTP/1.1");
+        while (rio_readlineb(&rio, buf, MAXLINE) > 0
+               && strcmp(buf, "\r\n") && strcmp(buf, "\n"))
+        {
+            if (!strncasecmp(buf, "Connection:", 11))
+            {
+                keep_alive = strstr(buf, "close") == NULL
+                             && strstr(buf, "Close") == NULL;
+            }
+        }
+        if (!respond(fd, path, keep_alive, &seed))
+        {
+            break;
+        }
+    }
+    Close(fd);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    int listenfd, *fdp, opt, bad = 0;
+    pthread_t tid;
+
+    while ((opt = getopt(argc, argv, "s:S:l:j:a:")) != -1)
+    {
+        switch (opt)
+        {
+        case 's':
+            min_size = atol(optarg);
+            break;
+        case 'S':
+            max_size = atol(optarg);
+            break;
+        case 'l':
+            latency_ms = atoi(optarg);
+            break;
+        case 'j':
+            jitter_ms = atoi(optarg);
+            break;
+        case 'a':
+            max_age = atoi(optarg);
+            break;
+        default:
+            bad = 1;
+            break;
+        }
+    }
+    if (bad || optind != argc - 1 || min_size < 1 || max_size < min_size)
+    {
+        fprintf(stderr, "usage: %s [-s <min>] [-S <max>] [-l <ms>] "
+                "[-j <ms>] [-a <secs>] <port>\n", argv[0]);
+        exit(1);
+    }
+
+    body = Malloc(max_size);
+    memset(body, 'x', max_size);
+    Signal(SIGPIPE, SIG_IGN);
+    listenfd = Open_listenfd(argv[optind]);
+    while (1)
+    {
+        fdp = Malloc(sizeof(int));
+        *fdp = Accept(listenfd, NULL, NULL);
+        Pthread_create(&tid, NULL, conn_thread, fdp);
+    }
+    return 0;
+}
@@ -1,127 +1,589 @@
-#ifndef CACHE_C
-#define CACHE_C
-
 #include "cache.h"
+#include "policy.h"
+#include "disk.h"
 
-/* cache_init: initialize the cache */
-void cache_init()
+cache* c;
+
+/* Eviction policy of every shard */
+static cache_policy *policy;
+
+/* Largest object kept at all, see -m */
+size_t cache_max_object = MAX_OBJECT_SIZE;
+
+/* Stale-while-revalidate window, see -g */
+int cache_grace;
+
+/* Bytes charged over all shards */
+static int total_size;
+
+/* Next shard to evict from once a shard runs empty */
+static unsigned evict_cursor;
+
+/*
+ * cache_hash: FNV-1a hash of the uri. Callers work it out once per
+ *             request and hand it to every lookup.
+ */
+unsigned cache_hash(const char *uri)
 {
-    c = (cache *)malloc(sizeof(cache));
-    c->head = NULL;
-    c->tail = NULL;
-    c->size = 0;
+    unsigned h = 2166136261u;
+    while (*uri)
+    {
+        h ^= (unsigned char)*uri++;
+        h *= 16777619u;
+    }
+    return h;
 }
 
-/* add_uri: Add the new cache line to the end of cache */
-void add_uri(char *uri, char *buf, int size)
+/*
+ * shard_of: low bits pick the shard, the remaining bits pick the
+ *           bucket, so the two stay independent.
+ */
+static cache *shard_of(unsigned hash)
 {
-    /* Set up the new cache line */
-    cache_t * new_line = (cache_t *)malloc(sizeof(cache_t));
-    new_line->content = malloc(size);
-    memcpy(new_line->content, buf, size);
-    new_line->size = size;
-    strcpy(new_line->uri, uri);
+    return &c[hash % CACHE_SHARDS];
+}
+
+/* bucket_of: bucket of a hash inside its shard */
+static cache_t **bucket_of(cache *s, unsigned hash)
+{
+    return &s->buckets[(hash / CACHE_SHARDS) & (s->nbuckets - 1)];
+}
 
-    /* add to cache */
-    /* No line in the cache */
-    if (c->head == NULL)
+/* lookup: find the line for uri in shard s, NULL if absent */
+static cache_t *lookup(cache *s, char *uri, unsigned hash)
+{
+    cache_t *curr = *bucket_of(s, hash);
+    while (curr != NULL)
     {
-        c->head = new_line;
-        c->tail = new_line;
-        new_line->prev = NULL;
-        new_line->next = NULL;
+        if (curr->hash == hash && !strcmp(uri, curr->uri))
+        {
+            return curr;
+        }
+        curr = curr->hnext;
     }
-    /* Add after tail */
-    else
+    return NULL;
+}
+
+/* grow: double the buckets of shard s and rehash every line */
+static void grow(cache *s)
+{
+    cache_t **old = s->buckets;
+    unsigned i, n = s->nbuckets;
+    cache_t *curr, *next, **b;
+
+    s->nbuckets = n * 2;
+    s->buckets = Calloc(s->nbuckets, sizeof(cache_t *));
+    for (i = 0; i < n; i++)
     {
-        c->tail->next = new_line;
-        new_line->prev = c->tail;
-        new_line->next = NULL;
-        c->tail = c->tail->next; 
-    }    
-    c->size += size;
+        for (curr = old[i]; curr != NULL; curr = next)
+        {
+            next = curr->hnext;
+            b = bucket_of(s, curr->hash);
+            curr->hnext = *b;
+            *b = curr;
+        }
+    }
+    Free(old);
 }
-/* find_fit: if exist, find the cached content, move the cache line
- *           to the end of cache, else return NULL.
+
+/* unlink_bucket: remove line from its hash bucket */
+static void unlink_bucket(cache *s, cache_t *line)
+{
+    cache_t **pp = bucket_of(s, line->hash);
+    while (*pp != line)
+    {
+        pp = &(*pp)->hnext;
+    }
+    *pp = line->hnext;
+}
+
+/* unlink_line: take line out of shard s and the budget, caller holds the
+ *              shard's write lock and still has to drop the cache's pin */
+static void unlink_line(cache *s, cache_t *line)
+{
+    unlink_bucket(s, line);
+    s->count--;
+    s->size -= line->size;
+    s->uri_bytes -= strlen(line->uri) + 1;
+    s->charge -= line->charge;
+    __sync_fetch_and_sub(&total_size, line->charge);
+}
+
+/*
+ * line_charge: memory taken by line. The allocator keeps a size word
+ *              in front of each block, and the line has a bucket slot.
  */
-cache_t *find_fit(char *uri)
+static int line_charge(cache_t *line)
 {
-    cache_t *curr = c->head;
-    while(curr != NULL)
+    return malloc_usable_size(line) + sizeof(size_t) + sizeof(cache_t *);
+}
+
+/*
+ * new_line: allocate a line with room for its uri and size bytes of
+ *           content in one block, the caller fills in the content.
+ */
+static cache_t *new_line(char *uri, unsigned hash, int size,
+                         cache_meta *meta)
+{
+    size_t uri_len = strlen(uri) + 1;
+    cache_t *line = Malloc(sizeof(cache_t) + uri_len + size);
+
+    line->uri = (char *)(line + 1);
+    memcpy(line->uri, uri, uri_len);
+    line->content = line->uri + uri_len;
+    line->size = size;
+    line->meta = *meta;
+    line->hash = hash;
+    line->ref = 0;
+    line->freq = 0;
+    line->refcnt = 1;
+    line->refreshing = 0;
+    line->charge = line_charge(line);
+    return line;
+}
+
+/*
+ * link_line: add line to its shard where the policy wants it, caller
+ *            holds the shard's write lock.
+ */
+static void link_line(cache *s, cache_t *new_line)
+{
+    cache_t **b;
+
+    /* add to hash table */
+    if (s->count >= s->nbuckets)
     {
-        // strcmp: return 0 when equal
-        if (!strcmp(uri, curr->uri))
+        grow(s);
+    }
+    b = bucket_of(s, new_line->hash);
+    new_line->hnext = *b;
+    *b = new_line;
+    s->count++;
+
+    s->size += new_line->size;
+    s->uri_bytes += strlen(new_line->uri) + 1;
+    s->charge += new_line->charge;
+    policy->insert(s, new_line);
+}
+
+/*
+ * cache_set_policy: evict with the policy called name from now on,
+ *                   before cache_init. Return -1 if there is none.
+ */
+int cache_set_policy(char *name)
+{
+    int i;
+
+    for (i = 0; cache_policies[i] != NULL; i++)
+    {
+        if (!strcmp(cache_policies[i]->name, name))
         {
-            /* if curr is head, need to move head pointer */
-            if (c->head == curr)
-            {
-                /* More than one cache line, move curr(head) after tail */
-                if (c->tail != curr)
-                {    
-                    c->head = c->head->next;
-                    curr->next->prev = NULL;
-                    c->tail->next = curr;
-                    curr->prev = c->tail;
-                    curr->next = NULL;
-                    c->tail = curr;
-                }
-            }
-            /* curr is not head */
-            else
-            {
-                /* if curr is tail, no need to move it */
-                if (c->tail != curr)
-                {   
-                    curr->next->prev = curr->prev;
-                    curr->prev->next = curr->next;
-                    curr->prev = c->tail;
-                    c->tail->next = curr;
-                    curr->next = NULL;
-                    c->tail = curr;
-                }
-            }    
-            return curr;
+            policy = cache_policies[i];
+            return 0;
         }
-        curr = curr->next;  
     }
-    return NULL;  
+    return -1;
 }
 
-/** delete_uri: Delete the first cache line in cache*/
-void delete_uri()
+/* cache_init: initialize the cache */
+void cache_init()
 {
-    cache_t *temp = c->tail;
-    /* Only one cache line in cache */
-    if (c->head->next == NULL)
+    int i;
+
+    if (policy == NULL)
     {
-        c->head = NULL;
-        c->tail = NULL;
+        policy = cache_policies[0];
+    }
+
+    c = (cache *)Calloc(CACHE_SHARDS, sizeof(cache));
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        c[i].size = 0;
+        c[i].uri_bytes = 0;
+        c[i].charge = 0;
+        c[i].nbuckets = CACHE_BUCKETS;
+        c[i].buckets = Calloc(CACHE_BUCKETS, sizeof(cache_t *));
+        c[i].count = 0;
+        c[i].hits = 0;
+        c[i].misses = 0;
+        c[i].evictions = 0;
+        if (policy->init != NULL)
+        {
+            policy->init(&c[i]);
+        }
 
+        Sem_init(&c[i].mutex, 0, 1);
+        Sem_init(&c[i].w, 0, 1);
+        c[i].readcnt = 0;
+    }
+    total_size = 0;
+    evict_cursor = 0;
+}
+
+/*
+ * add_uri: Add the new cache line to the end of its shard,
+ *          caller holds the shard's write lock.
+ */
+void add_uri(char *uri, unsigned hash, char *buf, int size,
+             cache_meta *meta)
+{
+    cache_t *line = new_line(uri, hash, size, meta);
+
+    memcpy(line->content, buf, size);
+    __sync_fetch_and_add(&total_size, line->charge);
+    link_line(shard_of(line->hash), line);
+}
+/*
+ * cache_restore: add a line saved in a snapshot, unless the cache has
+ *                it already or it would take the cache over its budget;
+ *                nothing is evicted for it. Return 0 if it was added.
+ */
+int cache_restore(char *uri, unsigned hash, char *buf, int size,
+                  cache_meta *meta)
+{
+    cache_t *line = new_line(uri, hash, size, meta);
+    cache *s = shard_of(hash);
+
+    cache_wlock(s);
+    if (total_size + line->charge > MAX_CACHE_SIZE
+        || lookup(s, uri, hash) != NULL)
+    {
+        cache_wunlock(s);
+        Free(line);
+        return -1;
+    }
+    memcpy(line->content, buf, size);
+    __sync_fetch_and_add(&total_size, line->charge);
+    link_line(s, line);
+    cache_wunlock(s);
+    return 0;
+}
+/* find_fit: if exist, find the cached content and tell the policy about
+ *           the hit or miss, else return NULL. Caller holds the shard's
+ *           read lock, or its write lock if the policy needs it.
+ */
+cache_t *find_fit(char *uri, unsigned hash)
+{
+    cache *s = shard_of(hash);
+    cache_t *curr = lookup(s, uri, hash);
+
+    if (curr != NULL)
+    {
+        __sync_fetch_and_add(&s->hits, 1);
+        policy->hit(s, curr);
     }
-    /* Delete the first one */
     else
     {
-        c->head->next->prev = NULL;
-        c->head = c->head->next;
+        __sync_fetch_and_add(&s->misses, 1);
+        if (policy->miss != NULL)
+        {
+            policy->miss(s, hash);
+        }
+    }
+    return curr;
+}
+
+/*
+ * delete_uri: Delete the cache line the policy picks in shard s.
+ *             Caller holds the shard's write lock.
+ */
+void delete_uri(cache *s)
+{
+    cache_t *temp = policy->evict(s);
+
+    unlink_line(s, temp);
+    s->evictions++;
 
+    /** Free space in the deleted one once no reader has it pinned, after
+     *  writing it to the disk tier if there is one */
+    if (disk_enabled())
+    {
+        disk_spill(temp);
+    }
+    else
+    {
+        cache_put(temp);
     }
-    /** Free space in the deleted one */
-    free(temp->content);
-    free(temp);   
 }
 /* cache_free: free the whole cache */
 void cache_free()
 {
     cache_t *curr;
-    curr = c->head;
     cache_t *temp;
-    while(curr != NULL)
+    int i, l;
+
+    for (i = 0; i < CACHE_SHARDS; i++)
     {
-        temp = curr;
-        curr = curr->next;
-        free(temp->content);
-        free(temp);
+        for (l = 0; l < CACHE_LISTS; l++)
+        {
+            curr = c[i].lists[l].head;
+            while(curr != NULL)
+            {
+                temp = curr;
+                curr = curr->next;
+                cache_put(temp);
+            }
+        }
+        if (policy->free != NULL)
+        {
+            policy->free(&c[i]);
+        }
+        Free(c[i].buckets);
     }
     free(c);
 }
-#endif
\ No newline at end of file
+
+/* cache_shard: the shard that owns a uri with this hash */
+cache *cache_shard(unsigned hash)
+{
+    return shard_of(hash);
+}
+
+/* cache_rlock: enter the shard as a reader, first reader locks out writers */
+void cache_rlock(cache *s)
+{
+    P(&s->mutex);
+    s->readcnt++;
+    if (s->readcnt == 1)
+    {
+        P(&s->w);
+    }
+    V(&s->mutex);
+}
+
+/* cache_runlock: leave the shard as a reader, last reader lets writers in */
+void cache_runlock(cache *s)
+{
+    P(&s->mutex);
+    s->readcnt--;
+    if (s->readcnt == 0)
+    {
+        V(&s->w);
+    }
+    V(&s->mutex);
+}
+
+/* cache_wlock: enter the shard as the only writer */
+void cache_wlock(cache *s)
+{
+    P(&s->w);
+}
+
+/* cache_wunlock: leave the shard as a writer */
+void cache_wunlock(cache *s)
+{
+    V(&s->w);
+}
+
+/*
+ * cache_insert: evict until the object fits, then add it to the cache.
+ *               The line is built first, so what it really costs is
+ *               known. Only one shard lock is held at a time: the uri's
+ *               own shard is evicted first, then the others in turn.
+ *               Objects too big for memory, over MAX_OBJECT_SIZE or the
+ *               whole budget, go straight to the disk tier if there is
+ *               one. The body is used up either way. A
+ *               line already there for uri is replaced: the new one was
+ *               fetched later, by a revalidation or a reload.
+ */
+void cache_insert(char *uri, unsigned hash, chain_t *body,
+                  cache_meta *meta)
+{
+    cache_t *line, *old;
+    cache *s, *victim;
+    int tries = 0;
+
+    if ((body->len > MAX_OBJECT_SIZE || body->len > MAX_CACHE_SIZE)
+        && disk_enabled())
+    {
+        disk_store(uri, body, meta);
+        return;
+    }
+    line = new_line(uri, hash, body->len, meta);
+    chain_copy(body, line->content);
+    chain_free(body);
+    /* Could never fit, whatever was evicted */
+    if (line->charge > MAX_CACHE_SIZE)
+    {
+        Free(line);
+        return;
+    }
+    s = victim = shard_of(line->hash);
+
+    __sync_fetch_and_add(&total_size, line->charge);
+    while (total_size > MAX_CACHE_SIZE && tries < CACHE_SHARDS)
+    {
+        cache_wlock(victim);
+        while (total_size > MAX_CACHE_SIZE && victim->count > 0)
+        {
+            delete_uri(victim);
+        }
+        cache_wunlock(victim);
+        victim = &c[__sync_fetch_and_add(&evict_cursor, 1) % CACHE_SHARDS];
+        tries++;
+    }
+
+    cache_wlock(s);
+    if ((old = lookup(s, uri, line->hash)) != NULL)
+    {
+        list_remove(s, old);
+        unlink_line(s, old);
+        cache_put(old);
+    }
+    link_line(s, line);
+    cache_wunlock(s);
+}
+
+/*
+ * cache_get: find uri and pin its line, so it can be used after the
+ *            shard lock is dropped. Return NULL on a miss.
+ */
+cache_t *cache_get(char *uri, unsigned hash)
+{
+    cache *s = shard_of(hash);
+    cache_t *hit;
+
+    /* A policy that relinks lines on a hit needs the shard to itself */
+    if (policy->hit_wlock)
+    {
+        cache_wlock(s);
+    }
+    else
+    {
+        cache_rlock(s);
+    }
+    hit = find_fit(uri, hash);
+    if (hit != NULL)
+    {
+        __sync_fetch_and_add(&hit->refcnt, 1);
+    }
+    if (policy->hit_wlock)
+    {
+        cache_wunlock(s);
+    }
+    else
+    {
+        cache_runlock(s);
+    }
+    return hit;
+}
+
+/* cache_put: drop one pin, the last one frees the line */
+void cache_put(cache_t *line)
+{
+    if (__sync_sub_and_fetch(&line->refcnt, 1) == 0)
+    {
+        Free(line);
+    }
+}
+
+/* cache_fresh: true if a response with meta may still be served as is */
+int cache_fresh(cache_meta *meta)
+{
+    return __atomic_load_n(&meta->expires, __ATOMIC_RELAXED) > time(NULL);
+}
+
+/* cache_in_grace: true if a stale response with meta may still be served
+ *                 while it is fetched again, which the server can forbid */
+int cache_in_grace(cache_meta *meta)
+{
+    return !meta->revalidate
+           && __atomic_load_n(&meta->expires, __ATOMIC_RELAXED) + cache_grace
+              > time(NULL);
+}
+
+/*
+ * cache_refresh: a revalidation said the pinned line is still current,
+ *                serve it for lifetime more seconds. Readers may look at
+ *                the expiry at the same time, so it is written atomically.
+ */
+void cache_refresh(cache_t *line, long lifetime)
+{
+    __atomic_store_n(&line->meta.expires, time(NULL) + lifetime,
+                     __ATOMIC_RELAXED);
+}
+
+/*
+ * cache_claim: take line for a background refresh and pin it. Return 0
+ *              if somebody else already has.
+ */
+int cache_claim(cache_t *line)
+{
+    if (!__sync_bool_compare_and_swap(&line->refreshing, 0, 1))
+    {
+        return 0;
+    }
+    __sync_fetch_and_add(&line->refcnt, 1);
+    return 1;
+}
+
+/* cache_unclaim: the refresh is over, a later one may start */
+void cache_unclaim(cache_t *line)
+{
+    __sync_lock_release(&line->refreshing);
+    cache_put(line);
+}
+
+/*
+ * cache_iov: describe line as up to 3 pieces for writev, with conn_hdr
+ *            put in front of the blank line that ends the header.
+ *            Return the number of pieces.
+ */
+int cache_iov(cache_t *line, const char *conn_hdr, struct iovec *iov)
+{
+    if (line->meta.hdr_len < 0)
+    {
+        iov[0].iov_base = line->content;
+        iov[0].iov_len = line->size;
+        return 1;
+    }
+    iov[0].iov_base = line->content;
+    iov[0].iov_len = line->meta.hdr_len;
+    iov[1].iov_base = (void *)conn_hdr;
+    iov[1].iov_len = strlen(conn_hdr);
+    iov[2].iov_base = line->content + line->meta.hdr_len;
+    iov[2].iov_len = line->size - line->meta.hdr_len;
+    return 3;
+}
+
+/* cache_get_stats: add up every shard, one read lock at a time */
+void cache_get_stats(cache_stats *st)
+{
+    cache *s;
+    int i;
+
+    memset(st, 0, sizeof(cache_stats));
+    st->resident_bytes = CACHE_SHARDS * sizeof(cache);
+    for (i = 0; i < CACHE_SHARDS; i++)
+    {
+        s = &c[i];
+        cache_rlock(s);
+        st->entries += s->count;
+        st->content_bytes += s->size;
+        st->uri_bytes += s->uri_bytes;
+        st->charged_bytes += s->charge;
+        st->hits += s->hits;
+        st->misses += s->misses;
+        st->evictions += s->evictions;
+        st->resident_bytes += s->charge
+                              + (long)s->nbuckets * sizeof(cache_t *);
+        cache_runlock(s);
+    }
+}
+
+/* cache_report: print what the cache holds against its budget */
+void cache_report(FILE *fp)
+{
+    cache_stats st;
+
+    cache_get_stats(&st);
+    fprintf(fp, "cache: %d entries, %ld content bytes, %ld uri bytes\n",
+            st.entries, st.content_bytes, st.uri_bytes);
+    fprintf(fp, "cache: %ld bytes charged of %d, %ld bytes resident\n",
+            st.charged_bytes, MAX_CACHE_SIZE, st.resident_bytes);
+    fprintf(fp, "cache: policy %s, %ld hits, %ld misses (%.1f%% hit ratio), "
+            "%ld evictions\n", policy->name, st.hits, st.misses,
+            st.hits + st.misses ? 100.0 * st.hits / (st.hits + st.misses)
+            : 0.0, st.evictions);
+    fflush(fp);
+}
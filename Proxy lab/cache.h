@@ -1,36 +1,143 @@
 #ifndef CACHE_H
 #define CACHE_H
-#include "csapp.h"
+#include "proxy.h"
+#include "chain.h"
+#include "http.h"
+#include <sys/uio.h>
+#include <malloc.h>
 
-/* Struct for a cache line */
+#define CACHE_SHARDS  16    /* Number of lock-striped shards */
+#define CACHE_BUCKETS 64    /* Initial hash buckets per shard */
+#define CACHE_LISTS    2    /* Queues an eviction policy can keep */
+
+/* Struct for what is known about a cached response besides its bytes */
+typedef struct cache_meta cache_meta;
+struct cache_meta
+{
+    int hdr_len;      /* Offset of the blank line ending the header, where
+                         our Connection field goes; -1 to send as is */
+    int framed;       /* Client can find the end without a close */
+    time_t expires;   /* Stale from then on, to be revalidated */
+    long lifetime;    /* Freshness a revalidation gives back, if the 304
+                         does not say */
+    char etag[HTTP_VALIDATOR_LEN];            /* Empty if none */
+    char last_modified[HTTP_VALIDATOR_LEN];   /* Empty if none */
+    int revalidate;   /* no-cache, must- or proxy-revalidate: never
+                         served stale, not even within the grace window */
+};
+
+/* Struct for a cache line, allocated in one block with its uri and
+ * content right behind it */
 typedef struct cache_line cache_t;
 struct cache_line
 {
-  
-  int size;
-  char uri[MAXLINE];
-  char *content;
+
+  int size;           /* Content bytes */
+  int charge;         /* Memory it really takes, counted in the budget */
+  unsigned hash;
+  int ref;            /* Set on a hit, cleared by the eviction hand */
+  int freq;           /* Hits counted by the policy, if it wants them */
+  int list;           /* Which of the shard's lists the line is on */
+  int refcnt;         /* Pins: one for the cache, one per reader */
+  int refreshing;     /* Being fetched again in the background */
+  char *uri;          /* Interned: only as long as the uri itself */
+  char *content;      /* Never changes once added */
+  cache_meta meta;
   cache_t *next;
   cache_t *prev;
+  cache_t *hnext;     /* Next line in the same hash bucket */
 };
 
-/* Struct for the cache */
-typedef struct cache_all cache;
-struct cache_all
+/* Struct for a list of lines in eviction order, oldest first */
+typedef struct cache_list cache_list;
+struct cache_list
 {
     cache_t *head;
     cache_t *tail;
-    int size;
+    int charge;
+};
+
+/* Struct for a cache shard: a hash table plus the eviction policy's
+ * lists and state */
+typedef struct cache_all cache;
+struct cache_all
+{
+    cache_list lists[CACHE_LISTS];
+    void *pstate;       /* Private to the policy */
+    int size;           /* Content bytes */
+    int uri_bytes;
+    int charge;         /* Sum of the lines' charges */
+    cache_t **buckets;
+    unsigned nbuckets;  /* Always a power of two */
+    unsigned count;
+
+    /* Counters for comparing policies */
+    long hits;
+    long misses;
+    long evictions;
+
+    /* Readers-writers lock for this shard (readers first) */
+    sem_t mutex;
+    sem_t w;
+    int readcnt;
+};
+
+/* Struct for what the cache holds, logically and really */
+typedef struct cache_stats cache_stats;
+struct cache_stats
+{
+    int entries;
+    long content_bytes;   /* The cached responses themselves */
+    long uri_bytes;
+    long charged_bytes;   /* What counts against MAX_CACHE_SIZE */
+    long resident_bytes;  /* Charged bytes plus hash tables and shards */
+    long hits;
+    long misses;
+    long evictions;
 };
 
-/* Variable for a cache */
-cache* c;
+/* Variable for a cache: an array of CACHE_SHARDS shards */
+extern cache* c;
+
+/* Largest object kept, in memory or on disk */
+extern size_t cache_max_object;
+
+/* Seconds a stale line is still served while it is fetched again */
+extern int cache_grace;
 
 /* Helper functions */
+int cache_set_policy(char *name);
 void cache_init();
-void add_uri(char *uri, char *buf, int size);
-cache_t *find_fit(char *uri);
-void delete_uri();
+unsigned cache_hash(const char *uri);
+void add_uri(char *uri, unsigned hash, char *buf, int size,
+             cache_meta *meta);
+cache_t *find_fit(char *uri, unsigned hash);
+void delete_uri(cache *s);
+int cache_restore(char *uri, unsigned hash, char *buf, int size,
+                  cache_meta *meta);
 void cache_free();
 
+/* Locking: callers lock the shard that owns the uri */
+cache *cache_shard(unsigned hash);
+void cache_rlock(cache *s);
+void cache_runlock(cache *s);
+void cache_wlock(cache *s);
+void cache_wunlock(cache *s);
+void cache_insert(char *uri, unsigned hash, chain_t *body,
+                  cache_meta *meta);
+
+/* Pinned lookups: the line stays valid until cache_put */
+cache_t *cache_get(char *uri, unsigned hash);
+void cache_put(cache_t *line);
+int cache_fresh(cache_meta *meta);
+int cache_in_grace(cache_meta *meta);
+void cache_refresh(cache_t *line, long lifetime);
+int cache_claim(cache_t *line);
+void cache_unclaim(cache_t *line);
+int cache_iov(cache_t *line, const char *conn_hdr, struct iovec *iov);
+
+/* Accounting */
+void cache_get_stats(cache_stats *st);
+void cache_report(FILE *fp);
+
 #endif
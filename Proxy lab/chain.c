@@ -0,0 +1,110 @@
+/*
+ * chain.c - byte chains built from pooled fixed-size segments.
+ *
+ * Responses on their way into the cache are kept in chains instead of
+ * a MAX_OBJECT_SIZE array on the stack, so an object can be as large
+ * as the configured limit and only takes the memory it needs. Freed
+ * segments go back to a small pool rather than to malloc.
+ */
+#include "chain.h"
+
+static chain_seg *pool;
+static int pool_len;
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* seg_alloc: an empty segment, from the pool if it has one */
+static chain_seg *seg_alloc()
+{
+    chain_seg *seg;
+
+    pthread_mutex_lock(&pool_lock);
+    if ((seg = pool) != NULL)
+    {
+        pool = seg->next;
+        pool_len--;
+    }
+    pthread_mutex_unlock(&pool_lock);
+    if (seg == NULL)
+    {
+        seg = Malloc(sizeof(chain_seg));
+    }
+    seg->next = NULL;
+    seg->len = 0;
+    return seg;
+}
+
+/* chain_init: start an empty chain */
+void chain_init(chain_t *ch)
+{
+    ch->head = NULL;
+    ch->tail = NULL;
+    ch->len = 0;
+}
+
+/* chain_append: add n bytes at the end of the chain */
+void chain_append(chain_t *ch, const char *buf, size_t n)
+{
+    size_t k;
+
+    while (n > 0)
+    {
+        if (ch->tail == NULL || ch->tail->len == CHAIN_SEGSIZE)
+        {
+            if (ch->tail == NULL)
+            {
+                ch->head = ch->tail = seg_alloc();
+            }
+            else
+            {
+                ch->tail = ch->tail->next = seg_alloc();
+            }
+        }
+        k = CHAIN_SEGSIZE - ch->tail->len;
+        if (k > n)
+        {
+            k = n;
+        }
+        memcpy(ch->tail->data + ch->tail->len, buf, k);
+        ch->tail->len += k;
+        ch->len += k;
+        buf += k;
+        n -= k;
+    }
+}
+
+/* chain_copy: gather the bytes of the chain into out */
+void chain_copy(chain_t *ch, char *out)
+{
+    chain_seg *seg;
+
+    for (seg = ch->head; seg != NULL; seg = seg->next)
+    {
+        memcpy(out, seg->data, seg->len);
+        out += seg->len;
+    }
+}
+
+/* chain_free: give the segments back, the chain is empty again */
+void chain_free(chain_t *ch)
+{
+    chain_seg *seg, *next;
+
+    for (seg = ch->head; seg != NULL; seg = next)
+    {
+        next = seg->next;
+        pthread_mutex_lock(&pool_lock);
+        if (pool_len < CHAIN_POOL_MAX)
+        {
+            seg->next = pool;
+            pool = seg;
+            pool_len++;
+            seg = NULL;
+        }
+        pthread_mutex_unlock(&pool_lock);
+        if (seg != NULL)
+        {
+            Free(seg);
+        }
+    }
+    chain_init(ch);
+}
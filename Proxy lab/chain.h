@@ -0,0 +1,32 @@
+#ifndef CHAIN_H
+#define CHAIN_H
+#include "csapp.h"
+
+#define CHAIN_SEGSIZE  16384   /* Bytes per segment */
+#define CHAIN_POOL_MAX   512   /* Free segments kept for reuse */
+
+/* Struct for one segment of a chain */
+typedef struct chain_seg chain_seg;
+struct chain_seg
+{
+    chain_seg *next;
+    size_t len;
+    char data[CHAIN_SEGSIZE];
+};
+
+/* Struct for bytes kept in a chain of segments, so that a growing
+ * object never needs one large block or a copy to grow */
+typedef struct chain chain_t;
+struct chain
+{
+    chain_seg *head;
+    chain_seg *tail;
+    size_t len;
+};
+
+void chain_init(chain_t *ch);
+void chain_append(chain_t *ch, const char *buf, size_t n);
+void chain_copy(chain_t *ch, char *out);
+void chain_free(chain_t *ch);
+
+#endif
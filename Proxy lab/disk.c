@@ -0,0 +1,510 @@
+/*
+ * disk.c - second cache tier in append-only segment files.
+ *
+ * Lines evicted from memory, and objects too large for memory, are
+ * handed to a writer thread, which appends them to the current segment
+ * file in a directory given at startup. An in-memory index maps each
+ * uri to its segment, offset and length, and hits are sent straight
+ * from the file with sendfile. When there are more than
+ * DISK_MAX_SEGMENTS segments, the oldest one goes, with everything in
+ * it. On startup the segments are mapped and scanned to rebuild the
+ * index, up to the first record that is torn or corrupt.
+ */
+#include "disk.h"
+#include <dirent.h>
+
+static char *disk_dir;
+static disk_ent *index_tab[DISK_BUCKETS];
+static int nentries;
+static long live_bytes;
+static long hits;
+
+/* Segments from oldest to newest, the last one is written to */
+static disk_seg *segs[DISK_MAX_SEGMENTS + 1];
+static int nsegs;
+
+/* Objects waiting for the writer */
+static disk_job *queue_head, *queue_tail;
+static int queue_len;
+static size_t queue_bytes;
+
+static pthread_mutex_t disk_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t disk_cond = PTHREAD_COND_INITIALIZER;
+
+/* fnv: continue an FNV-1a hash over n more bytes */
+static unsigned fnv(unsigned h, const char *p, size_t n)
+{
+    while (n-- > 0)
+    {
+        h ^= (unsigned char)*p++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/* seg_path: file name of segment id */
+static void seg_path(char *path, int id)
+{
+    snprintf(path, MAXLINE, "%s/seg.%06d", disk_dir, id);
+}
+
+/* seg_unref: drop one reference, the last one closes the file */
+static void seg_unref(disk_seg *seg)
+{
+    if (--seg->refcnt == 0)
+    {
+        Close(seg->fd);
+        Free(seg);
+    }
+}
+
+/* index_put: point uri at a record, disk_lock held */
+static void index_put(char *uri, size_t uri_len, disk_seg *seg, off_t off,
+                      int size, cache_meta *meta)
+{
+    unsigned hash = fnv(2166136261u, uri, uri_len);
+    disk_ent **b = &index_tab[hash % DISK_BUCKETS];
+    disk_ent *e;
+
+    for (e = *b; e != NULL; e = e->next)
+    {
+        if (e->hash == hash && strlen(e->uri) == uri_len
+            && !memcmp(e->uri, uri, uri_len))
+        {
+            break;
+        }
+    }
+    if (e == NULL)
+    {
+        e = Malloc(sizeof(disk_ent) + uri_len + 1);
+        memcpy(e->uri, uri, uri_len);
+        e->uri[uri_len] = '\0';
+        e->hash = hash;
+        e->next = *b;
+        *b = e;
+        nentries++;
+    }
+    else
+    {
+        live_bytes -= e->size;
+    }
+    e->seg = seg;
+    e->off = off;
+    e->size = size;
+    e->meta = *meta;
+    live_bytes += size;
+}
+
+/* drop_oldest: forget the oldest segment and what is in it, locked */
+static void drop_oldest()
+{
+    disk_seg *seg = segs[0];
+    char path[MAXLINE];
+    disk_ent **pp, *e;
+    int i;
+
+    for (i = 0; i < DISK_BUCKETS; i++)
+    {
+        pp = &index_tab[i];
+        while ((e = *pp) != NULL)
+        {
+            if (e->seg == seg)
+            {
+                *pp = e->next;
+                live_bytes -= e->size;
+                nentries--;
+                Free(e);
+            }
+            else
+            {
+                pp = &e->next;
+            }
+        }
+    }
+    seg_path(path, seg->id);
+    unlink(path);
+    memmove(&segs[0], &segs[1], (nsegs - 1) * sizeof(disk_seg *));
+    nsegs--;
+    /* Readers still sending from it keep the file open */
+    seg_unref(seg);
+}
+
+/* add_seg: open segment id as the newest one, disk_lock held */
+static disk_seg *add_seg(int id, int flags)
+{
+    char path[MAXLINE];
+    disk_seg *seg = Malloc(sizeof(disk_seg));
+
+    seg_path(path, id);
+    seg->id = id;
+    seg->fd = Open(path, O_RDWR | O_CREAT | flags, 0600);
+    seg->len = 0;
+    seg->refcnt = 1;
+    segs[nsegs++] = seg;
+    if (nsegs > DISK_MAX_SEGMENTS)
+    {
+        drop_oldest();
+    }
+    return seg;
+}
+
+/*
+ * scan: index the records of a segment of len bytes, mapped in memory.
+ *       Return where the valid records end.
+ */
+static off_t scan(disk_seg *seg, size_t len)
+{
+    char *base, *p;
+    disk_rec rec;
+    size_t off = 0;
+
+    if (len == 0)
+    {
+        return 0;
+    }
+    base = Mmap(NULL, len, PROT_READ, MAP_PRIVATE, seg->fd, 0);
+    while (off + sizeof(disk_rec) <= len)
+    {
+        memcpy(&rec, base + off, sizeof(disk_rec));
+        p = base + off + sizeof(disk_rec);
+        if (rec.magic != DISK_MAGIC || rec.uri_len >= MAXLINE
+            || rec.size > len
+            || off + sizeof(disk_rec) + rec.uri_len + rec.size > len
+            || fnv(2166136261u, p, rec.uri_len + rec.size) != rec.sum)
+        {
+            break;
+        }
+        index_put(p, rec.uri_len, seg,
+                  off + sizeof(disk_rec) + rec.uri_len, rec.size, &rec.meta);
+        off += sizeof(disk_rec) + rec.uri_len + rec.size;
+    }
+    Munmap(base, len);
+    return off;
+}
+
+/* cmp_int: qsort order for segment ids */
+static int cmp_int(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+/*
+ * pwrite_all: write every byte of iov at off, DISK_IOV_MAX pieces at a
+ *             time. Return 0, or -1 on an error.
+ */
+static int pwrite_all(int fd, struct iovec *iov, int iovcnt, off_t off)
+{
+    ssize_t n;
+    int cnt;
+
+    while (iovcnt > 0)
+    {
+        cnt = iovcnt < DISK_IOV_MAX ? iovcnt : DISK_IOV_MAX;
+        if ((n = pwritev(fd, iov, cnt, off)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return -1;
+        }
+        off += n;
+        /* Skip what was written */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+/* append: write a job at the end of the current segment and index it */
+static void append(disk_job *job)
+{
+    disk_rec rec;
+    disk_seg *seg;
+    struct iovec *iov;
+    chain_seg *cs;
+    size_t need;
+    off_t off;
+    int n = 2, ok;
+
+    /* Zeroed first: the padding is written to the segment too */
+    memset(&rec, 0, sizeof(rec));
+    rec.magic = DISK_MAGIC;
+    rec.uri_len = strlen(job->uri);
+    rec.size = job->size;
+    rec.meta = job->meta;
+    rec.sum = fnv(2166136261u, job->uri, rec.uri_len);
+    need = sizeof(disk_rec) + rec.uri_len + rec.size;
+    if (need > DISK_SEGMENT_SIZE)
+    {
+        return;
+    }
+
+    /* The content is one piece for a line, one per segment for a chain */
+    iov = Malloc((3 + job->body.len / CHAIN_SEGSIZE) * sizeof(struct iovec));
+    iov[0].iov_base = &rec;
+    iov[0].iov_len = sizeof(disk_rec);
+    iov[1].iov_base = job->uri;
+    iov[1].iov_len = rec.uri_len;
+    if (job->line != NULL)
+    {
+        iov[n].iov_base = job->line->content;
+        iov[n++].iov_len = rec.size;
+        rec.sum = fnv(rec.sum, job->line->content, rec.size);
+    }
+    for (cs = job->body.head; cs != NULL; cs = cs->next)
+    {
+        iov[n].iov_base = cs->data;
+        iov[n++].iov_len = cs->len;
+        rec.sum = fnv(rec.sum, cs->data, cs->len);
+    }
+
+    /* Only this thread appends, so the segment cannot change under us */
+    pthread_mutex_lock(&disk_lock);
+    if (segs[nsegs - 1]->len + need > DISK_SEGMENT_SIZE)
+    {
+        add_seg(segs[nsegs - 1]->id + 1, O_TRUNC);
+    }
+    seg = segs[nsegs - 1];
+    off = seg->len;
+    seg->refcnt++;
+    pthread_mutex_unlock(&disk_lock);
+
+    ok = (pwrite_all(seg->fd, iov, n, off) == 0);
+    Free(iov);
+
+    pthread_mutex_lock(&disk_lock);
+    /* A short write leaves garbage the next record overwrites */
+    if (ok && seg == segs[nsegs - 1])
+    {
+        seg->len = off + need;
+        index_put(job->uri, rec.uri_len, seg,
+                  off + sizeof(disk_rec) + rec.uri_len, rec.size,
+                  &job->meta);
+    }
+    seg_unref(seg);
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/* job_free: release what a job held */
+static void job_free(disk_job *job)
+{
+    if (job->line != NULL)
+    {
+        cache_put(job->line);
+    }
+    else
+    {
+        Free(job->uri);
+        chain_free(&job->body);
+    }
+    Free(job);
+}
+
+/* writer_thread: write queued jobs out forever */
+static void *writer_thread(void *vargp)
+{
+    disk_job *job;
+
+    Pthread_detach(Pthread_self());
+    while (1)
+    {
+        pthread_mutex_lock(&disk_lock);
+        while (queue_head == NULL)
+        {
+            pthread_cond_wait(&disk_cond, &disk_lock);
+        }
+        job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL)
+        {
+            queue_tail = NULL;
+        }
+        queue_len--;
+        queue_bytes -= job->size;
+        pthread_mutex_unlock(&disk_lock);
+
+        append(job);
+        job_free(job);
+    }
+    return NULL;
+}
+
+/*
+ * disk_init: keep evicted lines in segment files under dir, indexing
+ *            what earlier runs left there.
+ */
+void disk_init(char *dir)
+{
+    DIR *dp;
+    struct dirent *de;
+    struct stat st;
+    int ids[1024], nids = 0, id, i;
+    disk_seg *seg;
+    pthread_t tid;
+
+    disk_dir = dir;
+    if ((dp = opendir(dir)) == NULL)
+    {
+        unix_error("opendir error");
+    }
+    while ((de = readdir(dp)) != NULL && nids < 1024)
+    {
+        if (sscanf(de->d_name, "seg.%d", &id) == 1)
+        {
+            ids[nids++] = id;
+        }
+    }
+    closedir(dp);
+    qsort(ids, nids, sizeof(int), cmp_int);
+
+    for (i = 0; i < nids; i++)
+    {
+        seg = add_seg(ids[i], 0);
+        Fstat(seg->fd, &st);
+        seg->len = scan(seg, st.st_size);
+        if (seg->len < st.st_size && ftruncate(seg->fd, seg->len) < 0)
+        {
+            unix_error("ftruncate error");
+        }
+    }
+    if (nsegs == 0)
+    {
+        add_seg(0, O_TRUNC);
+    }
+    Pthread_create(&tid, NULL, writer_thread, NULL);
+}
+
+/* disk_enabled: whether there is a disk tier */
+int disk_enabled()
+{
+    return disk_dir != NULL;
+}
+
+/*
+ * enqueue: hand job to the writer, or drop it at once if the writer is
+ *          too far behind.
+ */
+static void enqueue(disk_job *job)
+{
+    job->next = NULL;
+    pthread_mutex_lock(&disk_lock);
+    if (queue_len >= DISK_QUEUE_MAX
+        || queue_bytes + job->size > DISK_QUEUE_BYTES)
+    {
+        pthread_mutex_unlock(&disk_lock);
+        job_free(job);
+        return;
+    }
+    if (queue_tail == NULL)
+    {
+        queue_head = job;
+    }
+    else
+    {
+        queue_tail->next = job;
+    }
+    queue_tail = job;
+    queue_len++;
+    queue_bytes += job->size;
+    pthread_cond_signal(&disk_cond);
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/*
+ * disk_spill: write an evicted line to disk. Takes over the caller's
+ *             pin, which is dropped once written.
+ */
+void disk_spill(cache_t *line)
+{
+    disk_job *job = Calloc(1, sizeof(disk_job));
+
+    job->line = line;
+    job->uri = line->uri;
+    job->size = line->size;
+    job->meta = line->meta;
+    enqueue(job);
+}
+
+/*
+ * disk_store: write an object that does not go in memory to disk. The
+ *             segments of body are taken over, body is left empty.
+ */
+void disk_store(char *uri, chain_t *body, cache_meta *meta)
+{
+    disk_job *job = Calloc(1, sizeof(disk_job));
+
+    job->uri = Malloc(strlen(uri) + 1);
+    strcpy(job->uri, uri);
+    job->body = *body;
+    job->size = body->len;
+    job->meta = *meta;
+    chain_init(body);
+    enqueue(job);
+}
+
+/*
+ * disk_get: find uri on disk. Return 1 with hit filled in and its
+ *           segment held open until disk_put, or 0 on a miss. A
+ *           stale copy is a miss too: it is fetched again in full.
+ */
+int disk_get(char *uri, disk_hit *hit)
+{
+    size_t uri_len = strlen(uri);
+    unsigned hash = fnv(2166136261u, uri, uri_len);
+    disk_ent *e;
+
+    if (disk_dir == NULL)
+    {
+        return 0;
+    }
+    pthread_mutex_lock(&disk_lock);
+    for (e = index_tab[hash % DISK_BUCKETS]; e != NULL; e = e->next)
+    {
+        if (e->hash == hash && !strcmp(e->uri, uri)
+            && cache_fresh(&e->meta))
+        {
+            e->seg->refcnt++;
+            hit->seg = e->seg;
+            hit->fd = e->seg->fd;
+            hit->off = e->off;
+            hit->size = e->size;
+            hit->meta = e->meta;
+            hits++;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&disk_lock);
+    return e != NULL;
+}
+
+/* disk_put: done sending a disk hit */
+void disk_put(disk_hit *hit)
+{
+    pthread_mutex_lock(&disk_lock);
+    seg_unref(hit->seg);
+    pthread_mutex_unlock(&disk_lock);
+}
+
+/* disk_report: print what the disk tier holds */
+void disk_report(FILE *fp)
+{
+    if (disk_dir == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&disk_lock);
+    fprintf(fp, "disk: %d entries, %ld bytes in %d segments, %ld hits\n",
+            nentries, live_bytes, nsegs, hits);
+    pthread_mutex_unlock(&disk_lock);
+    fflush(fp);
+}
@@ -0,0 +1,80 @@
+#ifndef DISK_H
+#define DISK_H
+#include "cache.h"
+
+#define DISK_SEGMENT_SIZE (64 << 20)   /* Bytes per segment file */
+#define DISK_MAX_SEGMENTS 16           /* Oldest segment goes beyond this */
+#define DISK_BUCKETS      16384
+#define DISK_QUEUE_MAX    256          /* Objects waiting to be written */
+#define DISK_QUEUE_BYTES  (64 << 20)   /* and their bytes at most */
+#define DISK_IOV_MAX      1024         /* Pieces per pwritev, as Linux */
+#define DISK_MAGIC        0x50524333u  /* "PRC3" */
+
+/* Struct for the header of a record in a segment, followed by the uri
+ * and then the content */
+typedef struct disk_rec disk_rec;
+struct disk_rec
+{
+    unsigned magic;
+    unsigned uri_len;
+    unsigned size;
+    cache_meta meta;
+    unsigned sum;      /* FNV-1a of uri and content, catches torn writes */
+};
+
+/* Struct for a segment file */
+typedef struct disk_seg disk_seg;
+struct disk_seg
+{
+    int id;
+    int fd;
+    off_t len;
+    int refcnt;        /* One while current, plus one per reader */
+};
+
+/* Struct for where a uri is on disk */
+typedef struct disk_ent disk_ent;
+struct disk_ent
+{
+    disk_seg *seg;
+    off_t off;         /* Of the content */
+    int size;
+    cache_meta meta;
+    unsigned hash;
+    disk_ent *next;
+    char uri[];
+};
+
+/* Struct for an object waiting for the writer: an evicted line, or the
+ * body of an object too large for memory */
+typedef struct disk_job disk_job;
+struct disk_job
+{
+    cache_t *line;     /* Pinned, or NULL */
+    char *uri;
+    chain_t body;      /* Empty for a line */
+    size_t size;
+    cache_meta meta;
+    disk_job *next;
+};
+
+/* Struct for a disk hit, the segment stays open until disk_put */
+typedef struct disk_hit disk_hit;
+struct disk_hit
+{
+    disk_seg *seg;
+    int fd;
+    off_t off;
+    int size;
+    cache_meta meta;
+};
+
+void disk_init(char *dir);
+int disk_enabled();
+void disk_spill(cache_t *line);
+void disk_store(char *uri, chain_t *body, cache_meta *meta);
+int disk_get(char *uri, disk_hit *hit);
+void disk_put(disk_hit *hit);
+void disk_report(FILE *fp);
+
+#endif
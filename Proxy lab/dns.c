@@ -0,0 +1,549 @@
+/*
+ * dns.c - shared name resolution cache with asynchronous resolvers.
+ *
+ * getaddrinfo() blocks, and the proxy used to call it on every miss.
+ * Resolved names are now kept for DNS_TTL_SECS (failures for
+ * DNS_NEG_TTL_SECS) in a table shared by all threads. Lookups run on a
+ * small pool of resolver threads, and a name has at most one lookup in
+ * flight: everyone who asks for it meanwhile waits for the same answer.
+ * Names from a hosts file given at startup never expire, which lets
+ * the proxy run offline.
+ */
+#include "dns.h"
+#include "metrics.h"
+#include <poll.h>
+
+/* Entry states */
+#define DNS_PENDING 0   /* a resolver is looking it up */
+#define DNS_READY   1
+#define DNS_FAILED  2
+
+/* Struct for someone waiting on a pending lookup */
+typedef struct dns_waiter dns_waiter;
+struct dns_waiter
+{
+    dns_cb *cb;
+    void *arg;
+    dns_waiter *next;
+};
+
+/* Struct for a cached name */
+typedef struct dns_entry dns_entry;
+struct dns_entry
+{
+    char name[MAXLINE];
+    int state;
+    int is_static;         /* from the hosts file, never expires */
+    time_t expires;
+    dns_addrs addrs;
+    dns_waiter *waiters;
+    dns_entry *next;       /* next entry in the same bucket */
+    dns_entry *qnext;      /* next entry waiting for a resolver */
+};
+
+static dns_entry *buckets[DNS_BUCKETS];
+static int nentries;
+static dns_entry *queue_head, *queue_tail;
+static pthread_mutex_t dns_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t dns_queue_cond = PTHREAD_COND_INITIALIZER;
+
+/* bucket_of: bucket for name */
+static dns_entry **bucket_of(char *name)
+{
+    unsigned h = 5381;
+    while (*name)
+    {
+        h = h * 33 + (unsigned char)tolower(*name++);
+    }
+    return &buckets[h % DNS_BUCKETS];
+}
+
+/* find: the entry for name, NULL if absent, dns_lock held */
+static dns_entry *find(char *name)
+{
+    dns_entry *e;
+    for (e = *bucket_of(name); e != NULL; e = e->next)
+    {
+        if (!strcasecmp(e->name, name))
+        {
+            return e;
+        }
+    }
+    return NULL;
+}
+
+/* create: add an empty entry for name, dns_lock held */
+static dns_entry *create(char *name)
+{
+    dns_entry **b = bucket_of(name);
+    dns_entry *e = Calloc(1, sizeof(dns_entry));
+
+    strncpy(e->name, name, MAXLINE - 1);
+    e->next = *b;
+    *b = e;
+    nentries++;
+    return e;
+}
+
+/* sweep: forget expired entries, dns_lock held */
+static void sweep(time_t now)
+{
+    int i;
+    dns_entry **pp, *e;
+
+    for (i = 0; i < DNS_BUCKETS; i++)
+    {
+        pp = &buckets[i];
+        while ((e = *pp) != NULL)
+        {
+            if (e->state != DNS_PENDING && !e->is_static && now >= e->expires)
+            {
+                *pp = e->next;
+                Free(e);
+                nentries--;
+            }
+            else
+            {
+                pp = &e->next;
+            }
+        }
+    }
+}
+
+/*
+ * evict - forget the entry closest to expiring that is neither pending
+ *         nor static, dns_lock held. Return 0 if there is none.
+ */
+static int evict(void)
+{
+    int i;
+    dns_entry **pp, **victim = NULL, *e;
+
+    for (i = 0; i < DNS_BUCKETS; i++)
+    {
+        for (pp = &buckets[i]; (e = *pp) != NULL; pp = &e->next)
+        {
+            if (e->state != DNS_PENDING && !e->is_static
+                && (victim == NULL || e->expires < (*victim)->expires))
+            {
+                victim = pp;
+            }
+        }
+    }
+    if (victim == NULL)
+    {
+        return 0;
+    }
+    e = *victim;
+    *victim = e->next;
+    Free(e);
+    nentries--;
+    return 1;
+}
+
+/* enqueue: hand e to the resolver threads, dns_lock held */
+static void enqueue(dns_entry *e)
+{
+    e->state = DNS_PENDING;
+    e->qnext = NULL;
+    if (queue_tail == NULL)
+    {
+        queue_head = e;
+    }
+    else
+    {
+        queue_tail->qnext = e;
+    }
+    queue_tail = e;
+    pthread_cond_signal(&dns_queue_cond);
+}
+
+/* numeric: fill out if name is a literal IPv4 or IPv6 address */
+static int numeric(char *name, dns_addrs *out)
+{
+    struct sockaddr_in *sin = (struct sockaddr_in *)&out->addr[0];
+    struct sockaddr_in6 *sin6 = (struct sockaddr_in6 *)&out->addr[0];
+
+    memset(&out->addr[0], 0, sizeof(out->addr[0]));
+    if (inet_pton(AF_INET, name, &sin->sin_addr) == 1)
+    {
+        sin->sin_family = AF_INET;
+        out->len[0] = sizeof(struct sockaddr_in);
+    }
+    else if (inet_pton(AF_INET6, name, &sin6->sin6_addr) == 1)
+    {
+        sin6->sin6_family = AF_INET6;
+        out->len[0] = sizeof(struct sockaddr_in6);
+    }
+    else
+    {
+        return 0;
+    }
+    out->n = 1;
+    return 1;
+}
+
+/* resolver_thread: run lookups from the queue forever */
+static void *resolver_thread(void *vargp)
+{
+    dns_entry *e;
+    dns_waiter *w, *next;
+    dns_addrs addrs;
+    struct addrinfo hints, *listp, *p;
+    char name[MAXLINE];
+    int rc;
+
+    Pthread_detach(Pthread_self());
+    while (1)
+    {
+        pthread_mutex_lock(&dns_lock);
+        while (queue_head == NULL)
+        {
+            pthread_cond_wait(&dns_queue_cond, &dns_lock);
+        }
+        e = queue_head;
+        queue_head = e->qnext;
+        if (queue_head == NULL)
+        {
+            queue_tail = NULL;
+        }
+        strcpy(name, e->name);
+        pthread_mutex_unlock(&dns_lock);
+
+        memset(&hints, 0, sizeof(struct addrinfo));
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_flags = AI_ADDRCONFIG;
+        addrs.n = 0;
+        if ((rc = getaddrinfo(name, NULL, &hints, &listp)) == 0)
+        {
+            for (p = listp; p && addrs.n < DNS_MAX_ADDRS; p = p->ai_next)
+            {
+                memcpy(&addrs.addr[addrs.n], p->ai_addr, p->ai_addrlen);
+                addrs.len[addrs.n] = p->ai_addrlen;
+                addrs.n++;
+            }
+            freeaddrinfo(listp);
+        }
+
+        /* Publish the answer, then wake everyone who waited for it */
+        pthread_mutex_lock(&dns_lock);
+        e->addrs = addrs;
+        e->state = addrs.n > 0 ? DNS_READY : DNS_FAILED;
+        e->expires = time(NULL)
+                     + (addrs.n > 0 ? DNS_TTL_SECS : DNS_NEG_TTL_SECS);
+        w = e->waiters;
+        e->waiters = NULL;
+        pthread_mutex_unlock(&dns_lock);
+
+        for (; w != NULL; w = next)
+        {
+            next = w->next;
+            w->cb(w->arg);
+            Free(w);
+        }
+    }
+    return NULL;
+}
+
+/* load_hosts: add the names of an /etc/hosts style file as static */
+static void load_hosts(char *hosts_file)
+{
+    FILE *fp = Fopen(hosts_file, "r");
+    char line[MAXLINE], *ip, *name, *save;
+    dns_addrs addr;
+    dns_entry *e;
+
+    while (Fgets(line, MAXLINE, fp) != NULL)
+    {
+        if ((name = strchr(line, '#')) != NULL)
+        {
+            *name = '\0';
+        }
+        if ((ip = strtok_r(line, " \t\r\n", &save)) == NULL
+            || !numeric(ip, &addr))
+        {
+            continue;
+        }
+        while ((name = strtok_r(NULL, " \t\r\n", &save)) != NULL)
+        {
+            if ((e = find(name)) == NULL)
+            {
+                e = create(name);
+            }
+            e->state = DNS_READY;
+            e->is_static = 1;
+            if (e->addrs.n < DNS_MAX_ADDRS)
+            {
+                e->addrs.addr[e->addrs.n] = addr.addr[0];
+                e->addrs.len[e->addrs.n] = addr.len[0];
+                e->addrs.n++;
+            }
+        }
+    }
+    Fclose(fp);
+}
+
+/* dns_init: start the resolvers, load hosts_file if not NULL */
+void dns_init(char *hosts_file)
+{
+    int i;
+    pthread_t tid;
+
+    if (hosts_file != NULL)
+    {
+        load_hosts(hosts_file);
+    }
+    for (i = 0; i < DNS_THREADS; i++)
+    {
+        Pthread_create(&tid, NULL, resolver_thread, NULL);
+    }
+}
+
+/*
+ * dns_get: look up hostname without blocking. Return 1 with *out filled
+ *          if the answer is known, -1 if the name is known not to
+ *          resolve, or 0 if a lookup is pending. In that case cb(arg)
+ *          runs on a resolver thread once it finished, and the caller
+ *          asks again. A full table makes room by forgetting the answer
+ *          closest to expiring; one full of pending lookups fails the
+ *          name.
+ */
+int dns_get(char *hostname, dns_addrs *out, dns_cb *cb, void *arg)
+{
+    dns_entry *e;
+    dns_waiter *w;
+    time_t now;
+    int rc;
+
+    if (numeric(hostname, out))
+    {
+        return 1;
+    }
+
+    now = time(NULL);
+    pthread_mutex_lock(&dns_lock);
+    if ((e = find(hostname)) == NULL)
+    {
+        if (nentries >= DNS_MAX_ENTRIES)
+        {
+            sweep(now);
+        }
+        if (nentries >= DNS_MAX_ENTRIES && !evict())
+        {
+            /* Every entry is a lookup in flight or from the hosts file */
+            pthread_mutex_unlock(&dns_lock);
+            return -1;
+        }
+        e = create(hostname);
+        enqueue(e);
+    }
+    else if (e->state != DNS_PENDING && !e->is_static && now >= e->expires)
+    {
+        enqueue(e);
+    }
+
+    if (e->state == DNS_READY)
+    {
+        *out = e->addrs;
+        rc = 1;
+    }
+    else if (e->state == DNS_FAILED)
+    {
+        rc = -1;
+    }
+    else
+    {
+        w = Malloc(sizeof(dns_waiter));
+        w->cb = cb;
+        w->arg = arg;
+        w->next = e->waiters;
+        e->waiters = w;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return rc;
+}
+
+/* wake: dns_cb that lets a thread blocked in dns_resolve go on */
+static void wake(void *arg)
+{
+    V((sem_t *)arg);
+}
+
+/*
+ * unwait - take the waiter with arg off the pending lookup of hostname,
+ *          dns_lock not held. Return 0 if the resolver already took it,
+ *          in which case its callback is about to run.
+ */
+static int unwait(char *hostname, void *arg)
+{
+    dns_entry *e;
+    dns_waiter **pp, *w;
+    int found = 0;
+
+    pthread_mutex_lock(&dns_lock);
+    if ((e = find(hostname)) != NULL)
+    {
+        for (pp = &e->waiters; (w = *pp) != NULL; pp = &w->next)
+        {
+            if (w->arg == arg)
+            {
+                *pp = w->next;
+                Free(w);
+                found = 1;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&dns_lock);
+    return found;
+}
+
+/*
+ * dns_resolve - look up hostname, blocking for at most timeout_ms.
+ *     Return 0, or -1 on failure, with errno ETIMEDOUT if the time ran
+ *     out. The lookup itself goes on, and answers those who ask later.
+ */
+int dns_resolve(char *hostname, dns_addrs *out, int timeout_ms)
+{
+    sem_t done;
+    struct timespec until;
+    int rc;
+
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (until.tv_nsec >= 1000000000)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000;
+    }
+
+    Sem_init(&done, 0, 0);
+    while ((rc = dns_get(hostname, out, wake, &done)) == 0)
+    {
+        while ((rc = sem_timedwait(&done, &until)) < 0 && errno == EINTR)
+        {
+            ;
+        }
+        if (rc < 0)
+        {
+            /* done lives on this stack: no callback may use it later */
+            if (!unwait(hostname, &done))
+            {
+                P(&done);
+            }
+            sem_destroy(&done);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    sem_destroy(&done);
+    return rc > 0 ? 0 : -1;
+}
+
+/* dns_set_port: put the numeric port into a resolved address */
+void dns_set_port(struct sockaddr_storage *addr, char *port)
+{
+    unsigned short p = htons((unsigned short)atoi(port));
+
+    if (addr->ss_family == AF_INET)
+    {
+        ((struct sockaddr_in *)addr)->sin_port = p;
+    }
+    else if (addr->ss_family == AF_INET6)
+    {
+        ((struct sockaddr_in6 *)addr)->sin6_port = p;
+    }
+}
+
+/*
+ * connect_within - connect fd to addr, giving up after ms milliseconds.
+ *     The socket is non-blocking while it connects, and blocking again
+ *     after. Return -1 with errno ETIMEDOUT if the time ran out.
+ */
+static int connect_within(int fd, struct sockaddr_storage *addr,
+                          socklen_t len, int ms)
+{
+    int flags, err = 0, rc;
+    socklen_t errlen = sizeof(err);
+    struct pollfd pfd;
+
+    if ((flags = fcntl(fd, F_GETFL, 0)) < 0
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+    {
+        return -1;
+    }
+    if (connect(fd, (SA *)addr, len) < 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            return -1;
+        }
+        pfd.fd = fd;
+        pfd.events = POLLOUT;
+        while ((rc = poll(&pfd, 1, ms)) < 0 && errno == EINTR)
+        {
+            ;
+        }
+        if (rc == 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        if (rc < 0 || getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0)
+        {
+            return -1;
+        }
+        if (err != 0)
+        {
+            errno = err;
+            return -1;
+        }
+    }
+    return fcntl(fd, F_SETFL, flags);
+}
+/*
+ * dns_open_clientfd - open_clientfd from csapp.c, with the name resolved
+ *     through the cache, and lookup and connection given up after
+ *     timeout_ms, over all addresses. Return -1 if it does not resolve
+ *     or no address accepts the connection, with errno ETIMEDOUT if the
+ *     time ran out.
+ */
+int dns_open_clientfd(char *hostname, char *port, int timeout_ms)
+{
+    dns_addrs addrs;
+    int i, clientfd, left, err;
+    long end = metrics_now() / 1000 + timeout_ms;
+
+    if (dns_resolve(hostname, &addrs, timeout_ms) < 0)
+    {
+        return -1;
+    }
+    errno = ECONNREFUSED;
+    for (i = 0; i < addrs.n; i++)
+    {
+        /* A slow lookup uses up the time too */
+        if ((left = end - metrics_now() / 1000) <= 0)
+        {
+            errno = ETIMEDOUT;
+            return -1;
+        }
+        dns_set_port(&addrs.addr[i], port);
+        if ((clientfd = socket(addrs.addr[i].ss_family, SOCK_STREAM, 0)) < 0)
+        {
+            continue;
+        }
+        if (connect_within(clientfd, &addrs.addr[i], addrs.len[i], left) == 0)
+        {
+            return clientfd;
+        }
+        err = errno;
+        Close(clientfd);
+        if ((errno = err) == ETIMEDOUT)
+        {
+            return -1;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,30 @@
+#ifndef DNS_H
+#define DNS_H
+#include "csapp.h"
+
+#define DNS_THREADS        4    /* Resolver threads */
+#define DNS_TTL_SECS      60    /* Keep a resolved name this long */
+#define DNS_NEG_TTL_SECS   5    /* Keep a failed lookup this long */
+#define DNS_MAX_ENTRIES 4096    /* Names cached at most */
+#define DNS_MAX_ADDRS      8    /* Addresses kept per name */
+#define DNS_BUCKETS      256
+
+/* Struct for the addresses of one name */
+typedef struct dns_addrs dns_addrs;
+struct dns_addrs
+{
+    int n;
+    struct sockaddr_storage addr[DNS_MAX_ADDRS];
+    socklen_t len[DNS_MAX_ADDRS];
+};
+
+/* Called from a resolver thread once a pending lookup finished */
+typedef void dns_cb(void *arg);
+
+void dns_init(char *hosts_file);
+int dns_get(char *hostname, dns_addrs *out, dns_cb *cb, void *arg);
+int dns_resolve(char *hostname, dns_addrs *out, int timeout_ms);
+void dns_set_port(struct sockaddr_storage *addr, char *port);
+int dns_open_clientfd(char *hostname, char *port, int timeout_ms);
+
+#endif
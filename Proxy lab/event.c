@@ -0,0 +1,1338 @@
+/*
+ * event.c - epoll event-loop mode for the proxy.
+ *
+ * Instead of creating a thread for every connection, a fixed pool of
+ * loop threads is started. Each thread owns one epoll instance and
+ * multiplexes its client and server sockets on it. All sockets are
+ * non-blocking, and every connection is a small state machine:
+ *
+ *     EV_REQUEST -> EV_HIT                                   (cache hit)
+ *     EV_REQUEST -> EV_DISK                                   (disk hit)
+ *     EV_REQUEST [-> EV_RESOLVE] -> EV_CONNECT -> EV_SEND -> EV_RELAY
+ *                                                        (cache miss)
+ *     ... -> EV_SEND -> EV_UPLOAD -> EV_RELAY         (POST, PUT, ...)
+ *     ... -> EV_CONNECT -> EV_TUNNEL                          (CONNECT)
+ *
+ * Requests other than GET skip the cache both ways; their body is
+ * streamed to the server through the request buffer. A CONNECT tunnel
+ * moves bytes with splice (see tunnel.c) whenever epoll says a side is
+ * ready, until both sides closed or it is idle for TUNNEL_IDLE_SECS.
+ *
+ * All loop threads wait on the same listening socket with
+ * EPOLLEXCLUSIVE, so the kernel wakes one of them per new connection.
+ * With several listening sockets (-l), loop i takes listener i modulo
+ * their number and stays on a core of its own; the kernel spreads the
+ * connections across the listeners (SO_REUSEPORT).
+ * Names not in the DNS cache are resolved by the resolver threads of
+ * dns.c; the connection waits in EV_RESOLVE and the resolver hands it
+ * back to its loop through an eventfd.
+ * A request to a server has the deadlines of the threaded mode: each
+ * loop keeps a timer wheel of EV_TICK_MS slots, the connections waiting
+ * on a server are filed in the slot of their next deadline, and every
+ * pass of the loop expires the slots it went past. A connection that
+ * times out before any of the response went out gets a 504.
+ * A connection and its buffers come from the slabs of its loop thread
+ * (see slab.c), each buffer sized for what it holds and taken only once
+ * needed: the request starts in EV_SMALL bytes and moves to MAXLINE if
+ * its header is longer, and the relay buffer waits for the response. An
+ * idle connection holds a few KB rather than the worst case.
+ * The cache is shared with the threaded mode and uses the same locks.
+ */
+#include "csapp.h"
+#include "proxy.h"
+#include "cache.h"
+#include "dns.h"
+#include "disk.h"
+#include "refresh.h"
+#include "metrics.h"
+#include "affinity.h"
+#include "tunnel.h"
+#include "slab.h"
+#include <limits.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+
+#define EV_MAXEVENTS 64       /* Events handled per epoll_wait */
+#define EV_BUFSIZE   16384    /* Server to client relay buffer */
+#define EV_SMALL     1024     /* Buffers to try before MAXLINE ones */
+#define EV_TICK_MS   100      /* Timer wheel resolution */
+#define EV_SLOTS     1024     /* Ticks the timer wheel spans */
+
+/* Connection states */
+#define EV_REQUEST 0   /* reading the request from client */
+#define EV_HIT     1   /* writing a cached object to client */
+#define EV_CONNECT 2   /* waiting for connect() to server */
+#define EV_SEND    3   /* writing the request to server */
+#define EV_RELAY   4   /* relaying the response to client */
+#define EV_RESOLVE 5   /* waiting for a resolver thread */
+#define EV_DISK    6   /* sending an object from the disk tier */
+#define EV_UPLOAD  7   /* streaming the request body to server */
+#define EV_TUNNEL  8   /* relaying a CONNECT tunnel both ways */
+
+/* Our Connection field, every client is closed after one response */
+static const char *ev_conn_close = "Connection: close\r\n";
+static const char *ev_continue = "HTTP/1.1 100 Continue\r\n\r\n";
+static const char *ev_established = "HTTP/1.1 200 Connection Established"
+                                    "\r\n\r\n";
+
+typedef struct conn conn_t;
+typedef struct loop loop_t;
+
+/* One socket registered in epoll, points back to its connection */
+typedef struct endpoint
+{
+    int fd;
+    unsigned events;   /* events currently registered */
+    conn_t *conn;      /* NULL for the listening socket */
+} endpoint_t;
+
+/* Struct for a proxied connection */
+struct conn
+{
+    endpoint_t client;
+    endpoint_t server;
+    loop_t *lp;
+    int state;
+    int closed;
+    int resolving;              /* a resolver thread may still use it */
+    conn_t *next_dead;
+    conn_t *next_ready;         /* resolved, back to the loop */
+
+    char *req;                  /* request read from client */
+    size_t req_cap;             /* EV_SMALL, or MAXLINE if it is more */
+    size_t req_len;
+    http_req hreq;              /* parsed in req as it arrives */
+    struct iovec req_iov[REQUEST_IOV_MAX];   /* request sent to server */
+    struct iovec *req_next;     /* what is left of it */
+    int req_iovcnt;
+    http_body upload;           /* request body going to server, */
+    size_t up_off;              /* the part of it in req not sent yet */
+    size_t up_len;
+    tunnel_dir tun[2];          /* CONNECT: client to server and back */
+    int tunneling;              /* tun holds pipes */
+    char *uri;                  /* cache key, see parse_uri, */
+    char *path;                 /* and path, both in one buffer */
+    size_t uri_cap;
+    unsigned hash;              /* its cache_hash */
+    char hostname[URI_HOST_MAX];
+    char port[URI_PORT_MAX];
+
+    char *buf;                  /* bytes read from server, not yet sent;
+                                   EV_BUFSIZE, taken once relaying */
+    size_t buf_len;
+    size_t buf_off;
+    int server_eof;
+
+    chain_t object;             /* copy for the cache */
+    int keep;                   /* 0 once the object is too big */
+
+    cache_t *hit;               /* pinned cache line being sent */
+    struct iovec hit_iov[3];
+    struct iovec *hit_next;     /* what is left of it */
+    int hit_iovcnt;
+
+    disk_hit dhit;              /* disk hit being sent, if dhit.seg */
+    int disk_step;              /* header, Connection field, body */
+    off_t disk_off;
+    size_t disk_left;           /* bytes left in this step */
+
+    long start;                 /* when the request was read, in us */
+    long connect_start;
+    char *stats;                /* our own stats response being sent */
+
+    long deadline;              /* for the whole response, in ms */
+    long timer;                 /* when the next timeout is due, 0 if
+                                   the connection is not on the wheel */
+    int slot;
+    conn_t *timer_prev;
+    conn_t *timer_next;
+    int sent;                   /* part of the response went out */
+};
+
+/* Struct for a loop thread */
+struct loop
+{
+    int id;
+    int pin;           /* keep the loop on core id */
+    int epfd;
+    endpoint_t listen;
+    endpoint_t wake;   /* eventfd written when lookups finish */
+    conn_t *dead;      /* closed connections, freed after each batch */
+
+    pthread_mutex_t ready_lock;
+    conn_t *ready;     /* connections whose lookup finished */
+
+    conn_t *wheel[EV_SLOTS];   /* connections by deadline tick */
+    long tick;                 /* next tick to expire */
+    int timers;                /* connections on the wheel */
+};
+
+/* Connections and their buffers, from the slabs of their loop thread */
+static slab_t conn_slab;
+static slab_t small_slab;      /* EV_SMALL bytes */
+static slab_t line_slab;       /* MAXLINE bytes */
+static slab_t relay_slab;      /* EV_BUFSIZE bytes */
+
+static void conn_close(loop_t *lp, conn_t *cp);
+
+/*
+ * ev_buf_get: a buffer of at least len bytes, from the smallest slab it
+ *             fits in; *cap is set to its size, to give it back with
+ */
+static char *ev_buf_get(size_t len, size_t *cap)
+{
+    if (len <= EV_SMALL)
+    {
+        *cap = EV_SMALL;
+        return slab_alloc(&small_slab);
+    }
+    if (len <= MAXLINE)
+    {
+        *cap = MAXLINE;
+        return slab_alloc(&line_slab);
+    }
+    *cap = len;
+    return Malloc(len);
+}
+
+/* ev_buf_put: give back a buffer from ev_buf_get */
+static void ev_buf_put(char *buf, size_t cap)
+{
+    if (cap == EV_SMALL)
+    {
+        slab_free(&small_slab, buf);
+    }
+    else if (cap == MAXLINE)
+    {
+        slab_free(&line_slab, buf);
+    }
+    else
+    {
+        Free(buf);
+    }
+}
+
+/* ev_req_grow: move the request to a MAXLINE buffer. The parser keeps
+ * offsets into it, so what it parsed so far stays valid */
+static void ev_req_grow(conn_t *cp)
+{
+    size_t cap;
+    char *req = ev_buf_get(MAXLINE, &cap);
+
+    memcpy(req, cp->req, cp->req_len);
+    ev_buf_put(cp->req, cp->req_cap);
+    cp->req = req;
+    cp->req_cap = cap;
+}
+
+/* set_nonblock: put fd in non-blocking mode */
+static int set_nonblock(int fd)
+{
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0)
+    {
+        return -1;
+    }
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* ev_watch: change the events we wait for on ep */
+static void ev_watch(loop_t *lp, endpoint_t *ep, unsigned events)
+{
+    struct epoll_event ev;
+
+    if (ep->events == events)
+    {
+        return;
+    }
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(lp->epfd, EPOLL_CTL_MOD, ep->fd, &ev) < 0)
+    {
+        unix_error("epoll_ctl error");
+    }
+    ep->events = events;
+}
+
+/* ev_add: register ep with the loop */
+static int ev_add(loop_t *lp, endpoint_t *ep, unsigned events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = ep;
+    ep->events = events;
+    return epoll_ctl(lp->epfd, EPOLL_CTL_ADD, ep->fd, &ev);
+}
+
+/* ev_now: a monotonic clock in milliseconds, for the deadlines */
+static long ev_now()
+{
+    return metrics_now() / 1000;
+}
+
+/* timer_stop: take cp off the timer wheel */
+static void timer_stop(loop_t *lp, conn_t *cp)
+{
+    if (cp->timer == 0)
+    {
+        return;
+    }
+    if (cp->timer_prev != NULL)
+    {
+        cp->timer_prev->timer_next = cp->timer_next;
+    }
+    else
+    {
+        lp->wheel[cp->slot] = cp->timer_next;
+    }
+    if (cp->timer_next != NULL)
+    {
+        cp->timer_next->timer_prev = cp->timer_prev;
+    }
+    cp->timer = 0;
+    lp->timers--;
+}
+
+/*
+ * timer_file: put cp on the wheel to time out at at. Beyond the reach
+ *             of the wheel, it waits in the farthest slot and is filed
+ *             again from there.
+ */
+static void timer_file(loop_t *lp, conn_t *cp, long at)
+{
+    long tick = (at + EV_TICK_MS - 1) / EV_TICK_MS;
+
+    /* An empty wheel need not catch up on the ticks it slept through */
+    if (lp->timers == 0)
+    {
+        lp->tick = ev_now() / EV_TICK_MS;
+    }
+    if (tick >= lp->tick + EV_SLOTS)
+    {
+        tick = lp->tick + EV_SLOTS - 1;
+    }
+    else if (tick < lp->tick)
+    {
+        tick = lp->tick;
+    }
+    cp->timer = at;
+    cp->slot = tick % EV_SLOTS;
+    cp->timer_prev = NULL;
+    cp->timer_next = lp->wheel[cp->slot];
+    if (cp->timer_next != NULL)
+    {
+        cp->timer_next->timer_prev = cp;
+    }
+    lp->wheel[cp->slot] = cp;
+    lp->timers++;
+}
+
+/*
+ * timer_start: time cp out ms from now, or at its deadline if that is
+ *              sooner. With ms 0 only the deadline is left.
+ */
+static void timer_start(loop_t *lp, conn_t *cp, long ms)
+{
+    long at = ev_now() + ms;
+
+    timer_stop(lp, cp);
+    timer_file(lp, cp, (ms == 0 || at > cp->deadline) ? cp->deadline : at);
+}
+
+/* ev_accept: accept every pending connection on the listening socket */
+static void ev_accept(loop_t *lp)
+{
+    int fd;
+    conn_t *cp;
+
+    while ((fd = accept(lp->listen.fd, NULL, NULL)) >= 0)
+    {
+        if (set_nonblock(fd) < 0)
+        {
+            Close(fd);
+            continue;
+        }
+        cp = slab_alloc(&conn_slab);
+        memset(cp, 0, sizeof(conn_t));
+        cp->req = ev_buf_get(EV_SMALL, &cp->req_cap);
+        cp->client.fd = fd;
+        cp->client.conn = cp;
+        cp->lp = lp;
+        cp->server.fd = -1;
+        cp->server.conn = cp;
+        cp->state = EV_REQUEST;
+        http_req_init(&cp->hreq);
+        if (ev_add(lp, &cp->client, EPOLLIN) < 0)
+        {
+            Close(fd);
+            ev_buf_put(cp->req, cp->req_cap);
+            slab_free(&conn_slab, cp);
+            continue;
+        }
+        metrics_count(METRIC_CONNECTIONS, 1);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED
+        && errno != EINTR)
+    {
+        fprintf(stderr, "accept error: %s\n", strerror(errno));
+    }
+}
+
+/* ev_connect: start a non-blocking connect to one of addrs */
+static int ev_connect(dns_addrs *addrs, char *port)
+{
+    int i, fd;
+
+    for (i = 0; i < addrs->n; i++)
+    {
+        dns_set_port(&addrs->addr[i], port);
+        if ((fd = socket(addrs->addr[i].ss_family, SOCK_STREAM, 0)) < 0)
+        {
+            continue;
+        }
+        if (set_nonblock(fd) == 0
+            && (connect(fd, (SA *)&addrs->addr[i], addrs->len[i]) == 0
+                || errno == EINPROGRESS))
+        {
+            return fd;
+        }
+        Close(fd);
+    }
+    return -1;
+}
+
+/* ev_dns_done: dns_cb, give the connection back to its loop */
+static void ev_dns_done(void *arg)
+{
+    conn_t *cp = (conn_t *)arg;
+    loop_t *lp = cp->lp;
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&lp->ready_lock);
+    cp->next_ready = lp->ready;
+    lp->ready = cp;
+    pthread_mutex_unlock(&lp->ready_lock);
+    if (write(lp->wake.fd, &one, sizeof(one)) < 0)
+    {
+        unix_error("eventfd write error");
+    }
+}
+
+/* ev_resolve: connect to the server, once its name is resolved */
+static void ev_resolve(loop_t *lp, conn_t *cp)
+{
+    dns_addrs addrs;
+    int rc;
+
+    if ((rc = dns_get(cp->hostname, &addrs, ev_dns_done, cp)) == 0)
+    {
+        cp->resolving = 1;
+        cp->state = EV_RESOLVE;
+        ev_watch(lp, &cp->client, 0);
+        return;
+    }
+    if (rc < 0 || (cp->server.fd = ev_connect(&addrs, cp->port)) < 0)
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    if (ev_add(lp, &cp->server, EPOLLOUT) < 0)
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    cp->keep = (cp->hreq.kind == HTTP_GET);
+    cp->state = EV_CONNECT;
+    ev_watch(lp, &cp->client, 0);
+}
+
+/*
+ * ev_fetch: send the request to server, once connected. A body comes
+ *           after the header, starting with what came with the header.
+ */
+static void ev_fetch(loop_t *lp, conn_t *cp)
+{
+    size_t off = cp->hreq.hdr_len;
+
+    cp->connect_start = metrics_now();
+    /* A body is streamed through req, give it room */
+    http_req_body_init(&cp->upload, &cp->hreq);
+    if (!cp->upload.done && cp->req_cap < MAXLINE)
+    {
+        ev_req_grow(cp);
+    }
+    cp->req_iovcnt = build_request(cp->req_iov, cp->hostname, cp->port,
+                                   cp->path, 0, "", &cp->hreq, cp->req);
+    cp->req_next = cp->req_iov;
+    cp->up_off = off;
+    cp->up_len = off + http_body_feed(&cp->upload, cp->req + off,
+                                      cp->req_len - off);
+    cp->deadline = ev_now() + total_timeout_ms;
+    timer_start(lp, cp, connect_timeout_ms);
+    ev_resolve(lp, cp);
+}
+
+/* ev_request: read the request, serve from cache or contact server */
+static void ev_request(loop_t *lp, conn_t *cp)
+{
+    char uri[MAXLINE], key[MAXLINE], path[MAXLINE];
+    ssize_t n;
+    size_t len, key_len;
+    int rc;
+
+    /* Most headers fit in a small buffer, the others get MAXLINE */
+    if (cp->req_len == cp->req_cap)
+    {
+        ev_req_grow(cp);
+    }
+    n = read(cp->client.fd, cp->req + cp->req_len,
+             cp->req_cap - cp->req_len);
+    if (n <= 0)
+    {
+        if (n == 0 || (errno != EAGAIN && errno != EINTR))
+        {
+            conn_close(lp, cp);
+        }
+        return;
+    }
+    cp->req_len += n;
+
+    /* Wait for the whole header block */
+    if ((rc = http_req_parse(&cp->hreq, cp->req, cp->req_len)) <= 0)
+    {
+        if (rc < 0 || cp->req_len == MAXLINE)
+        {
+            conn_close(lp, cp);
+        }
+        return;
+    }
+    memcpy(uri, cp->req + cp->hreq.uri.off, cp->hreq.uri.len);
+    uri[cp->hreq.uri.len] = '\0';
+    cp->start = metrics_now();
+    metrics_count(METRIC_REQUESTS, 1);
+
+    /* A body the server could read otherwise than we do is refused,
+     * and so is a body on a GET, which would go on without framing */
+    if (!http_req_framing_ok(&cp->hreq))
+    {
+        cp->hit_iov[0].iov_base = (void *)bad_request;
+        cp->hit_iov[0].iov_len = strlen(bad_request);
+        cp->hit_iovcnt = 1;
+        cp->hit_next = cp->hit_iov;
+        cp->state = EV_HIT;
+        ev_watch(lp, &cp->client, EPOLLOUT);
+        return;
+    }
+
+    /* Asked of the proxy itself: sent like a cache hit */
+    if (!strcmp(uri, METRICS_PATH))
+    {
+        cp->stats = metrics_response(ev_conn_close, &len);
+        cp->hit_iov[0].iov_base = cp->stats;
+        cp->hit_iov[0].iov_len = len;
+        cp->hit_iovcnt = 1;
+        cp->hit_next = cp->hit_iov;
+        cp->state = EV_HIT;
+        ev_watch(lp, &cp->client, EPOLLOUT);
+        return;
+    }
+    if (parse_uri(uri, cp->hostname, path, cp->port, key) < 0)
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    key_len = strlen(key) + 1;
+    cp->uri = ev_buf_get(key_len + strlen(path) + 1, &cp->uri_cap);
+    cp->path = cp->uri + key_len;
+    memcpy(cp->uri, key, key_len);
+    strcpy(cp->path, path);
+    cp->hash = cache_hash(cp->uri);
+    if (cp->hreq.kind != HTTP_GET)
+    {
+        if (cp->hreq.kind != HTTP_CONNECT)
+        {
+            metrics_count(METRIC_PASSED, 1);
+        }
+        ev_fetch(lp, cp);
+        return;
+    }
+
+    /* Hit in cache: the line stays pinned until it is sent. Without
+     * a way to revalidate here, a stale line is fetched again, unless
+     * it is within the grace window: the refresher takes care of it */
+    if ((cp->hit = cache_get(cp->uri, cp->hash)) != NULL
+        && !cache_fresh(&cp->hit->meta))
+    {
+        if (cache_in_grace(&cp->hit->meta))
+        {
+            refresh_start(cp->hit);
+        }
+        else
+        {
+            cache_put(cp->hit);
+            cp->hit = NULL;
+        }
+    }
+    if (cp->hit != NULL)
+    {
+        cp->hit_iovcnt = cache_iov(cp->hit, ev_conn_close, cp->hit_iov);
+        cp->hit_next = cp->hit_iov;
+        metrics_count(METRIC_MEM_HITS, 1);
+        metrics_count(METRIC_BYTES, cp->hit->size);
+        cp->state = EV_HIT;
+        ev_watch(lp, &cp->client, EPOLLOUT);
+        return;
+    }
+
+    /* Hit on disk: the segment stays open until it is sent. A response
+     * stored as sent by the server is all one step. */
+    if (disk_get(cp->uri, &cp->dhit))
+    {
+        cp->disk_off = cp->dhit.off;
+        if (cp->dhit.meta.hdr_len < 0)
+        {
+            cp->disk_step = 2;
+            cp->disk_left = cp->dhit.size;
+        }
+        else
+        {
+            cp->disk_step = 0;
+            cp->disk_left = cp->dhit.meta.hdr_len;
+        }
+        metrics_count(METRIC_DISK_HITS, 1);
+        metrics_count(METRIC_BYTES, cp->dhit.size);
+        cp->state = EV_DISK;
+        ev_watch(lp, &cp->client, EPOLLOUT);
+        return;
+    }
+
+    /* Not in cache */
+    metrics_count(METRIC_MISSES, 1);
+    ev_fetch(lp, cp);
+}
+
+/*
+ * ev_writev: write the iovcnt pieces left at *next to fd, moving both
+ *            past what was written. Return 1 once all is written, 0 if
+ *            fd cannot take more now, -1 on an error.
+ */
+static int ev_writev(int fd, struct iovec **next, int *iovcnt)
+{
+    ssize_t n;
+    struct iovec *iov = *next;
+
+    while (*iovcnt > 0)
+    {
+        n = writev(fd, iov, *iovcnt);
+        if (n < 0)
+        {
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        }
+        /* Skip what was written */
+        while (*iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            (*iovcnt)--;
+        }
+        if (*iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+        *next = iov;
+    }
+    return 1;
+}
+
+/* ev_hit: write the cached object to client */
+static void ev_hit(loop_t *lp, conn_t *cp)
+{
+    int rc = ev_writev(cp->client.fd, &cp->hit_next, &cp->hit_iovcnt);
+
+    if (rc <= 0)
+    {
+        if (rc < 0)
+        {
+            conn_close(lp, cp);
+        }
+        return;
+    }
+    if (cp->hit != NULL)
+    {
+        metrics_latency(LATENCY_HIT, cp->start);
+    }
+    conn_close(lp, cp);
+}
+
+/*
+ * ev_disk: send a disk hit to client with sendfile, our Connection field
+ *          going between the header and the body
+ */
+static void ev_disk(loop_t *lp, conn_t *cp)
+{
+    size_t conn_len = strlen(ev_conn_close);
+    ssize_t n;
+
+    while (1)
+    {
+        if (cp->disk_left == 0)
+        {
+            if (cp->disk_step == 2)
+            {
+                break;
+            }
+            cp->disk_step++;
+            cp->disk_left = (cp->disk_step == 1) ? conn_len
+                            : cp->dhit.size - cp->dhit.meta.hdr_len;
+            continue;
+        }
+        if (cp->disk_step == 1)
+        {
+            n = write(cp->client.fd,
+                      ev_conn_close + conn_len - cp->disk_left,
+                      cp->disk_left);
+        }
+        else
+        {
+            n = sendfile(cp->client.fd, cp->dhit.fd, &cp->disk_off,
+                         cp->disk_left);
+        }
+        if (n <= 0)
+        {
+            if (n == 0 || (errno != EAGAIN && errno != EINTR))
+            {
+                conn_close(lp, cp);
+            }
+            return;
+        }
+        cp->disk_left -= n;
+    }
+    metrics_latency(LATENCY_HIT, cp->start);
+    conn_close(lp, cp);
+}
+
+/*
+ * ev_upload: stream the request body from client to server. What is in
+ *            req goes first, and only then is req filled again.
+ */
+static void ev_upload(loop_t *lp, conn_t *cp)
+{
+    ssize_t n;
+
+    while (!cp->upload.done || cp->up_off < cp->up_len)
+    {
+        if (cp->up_off == cp->up_len)
+        {
+            /* A body that cannot be followed cannot be passed on */
+            if (cp->upload.bad)
+            {
+                conn_close(lp, cp);
+                return;
+            }
+            n = read(cp->client.fd, cp->req, cp->req_cap);
+            if (n <= 0)
+            {
+                if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                {
+                    conn_close(lp, cp);
+                    return;
+                }
+                ev_watch(lp, &cp->server, 0);
+                ev_watch(lp, &cp->client, EPOLLIN);
+                return;
+            }
+            cp->up_off = 0;
+            cp->up_len = http_body_feed(&cp->upload, cp->req, n);
+            continue;
+        }
+        n = write(cp->server.fd, cp->req + cp->up_off,
+                  cp->up_len - cp->up_off);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                conn_close(lp, cp);
+                return;
+            }
+            ev_watch(lp, &cp->client, 0);
+            ev_watch(lp, &cp->server, EPOLLOUT);
+            return;
+        }
+        cp->up_off += n;
+        timer_start(lp, cp, read_timeout_ms);
+    }
+    cp->state = EV_RELAY;
+    ev_watch(lp, &cp->client, 0);
+    ev_watch(lp, &cp->server, EPOLLIN);
+}
+
+/*
+ * ev_tunnel: move what the tunnel can move, then wait for a side to
+ *            read from while its way is empty, or to write to while
+ *            the other way has bytes queued.
+ */
+static void ev_tunnel(loop_t *lp, conn_t *cp)
+{
+    tunnel_dir *up = &cp->tun[0], *down = &cp->tun[1];
+
+    if (tunnel_pump(up) < 0 || tunnel_pump(down) < 0
+        || (up->eof && down->eof))
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    ev_watch(lp, &cp->client, (!up->eof && up->queued == 0 ? EPOLLIN : 0)
+                              | (down->queued > 0 ? EPOLLOUT : 0));
+    ev_watch(lp, &cp->server, (!down->eof && down->queued == 0 ? EPOLLIN : 0)
+                              | (up->queued > 0 ? EPOLLOUT : 0));
+    timer_start(lp, cp, TUNNEL_IDLE_SECS * 1000);
+}
+
+/*
+ * ev_tunnel_start: the server of a CONNECT is connected. Tell the
+ *                  client, pass on what it sent behind its request, and
+ *                  start the tunnel, which has no deadline but an idle
+ *                  timeout. The writes are small and the sockets fresh,
+ *                  so they go out at once or the connection is dropped.
+ */
+static void ev_tunnel_start(loop_t *lp, conn_t *cp)
+{
+    size_t len = strlen(ev_established);
+    size_t off = cp->hreq.hdr_len;
+
+    if (write(cp->client.fd, ev_established, len) != (ssize_t)len
+        || (cp->req_len > off
+            && write(cp->server.fd, cp->req + off, cp->req_len - off)
+               != (ssize_t)(cp->req_len - off))
+        || tunnel_open(&cp->tun[0], cp->client.fd, cp->server.fd) < 0)
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    if (tunnel_open(&cp->tun[1], cp->server.fd, cp->client.fd) < 0)
+    {
+        tunnel_close(&cp->tun[0]);
+        conn_close(lp, cp);
+        return;
+    }
+    cp->tunneling = 1;
+    cp->sent = 1;
+    cp->deadline = LONG_MAX;
+    cp->state = EV_TUNNEL;
+    metrics_count(METRIC_TUNNELS, 1);
+    ev_tunnel(lp, cp);
+}
+
+/* ev_send: finish connecting and write the request to server */
+static void ev_send(loop_t *lp, conn_t *cp)
+{
+    int err = 0, rc;
+    socklen_t len = sizeof(err);
+    ssize_t n = strlen(ev_continue);
+
+    if (cp->state == EV_CONNECT)
+    {
+        if (getsockopt(cp->server.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0
+            || err != 0)
+        {
+            conn_close(lp, cp);
+            return;
+        }
+        metrics_latency(LATENCY_CONNECT, cp->connect_start);
+        if (cp->hreq.kind == HTTP_CONNECT)
+        {
+            ev_tunnel_start(lp, cp);
+            return;
+        }
+        timer_start(lp, cp, read_timeout_ms);
+        cp->state = EV_SEND;
+    }
+    if ((rc = ev_writev(cp->server.fd, &cp->req_next,
+                        &cp->req_iovcnt)) <= 0)
+    {
+        if (rc < 0)
+        {
+            conn_close(lp, cp);
+        }
+        return;
+    }
+    /* A GET goes without its body, if it has one */
+    if (cp->hreq.kind != HTTP_GET
+        && (!cp->upload.done || cp->up_off < cp->up_len))
+    {
+        if (cp->hreq.expect_continue
+            && write(cp->client.fd, ev_continue, n) != n)
+        {
+            conn_close(lp, cp);
+            return;
+        }
+        cp->state = EV_UPLOAD;
+        ev_upload(lp, cp);
+        return;
+    }
+    cp->state = EV_RELAY;
+    ev_watch(lp, &cp->server, EPOLLIN);
+}
+
+/* ev_flush: write buffered response to client, true once drained */
+static int ev_flush(loop_t *lp, conn_t *cp)
+{
+    ssize_t n;
+
+    while (cp->buf_off < cp->buf_len)
+    {
+        n = write(cp->client.fd, cp->buf + cp->buf_off,
+                  cp->buf_len - cp->buf_off);
+        if (n < 0)
+        {
+            if (errno != EAGAIN && errno != EINTR)
+            {
+                conn_close(lp, cp);
+            }
+            return 0;
+        }
+        cp->buf_off += n;
+        cp->sent = 1;
+        metrics_count(METRIC_BYTES, n);
+    }
+    cp->buf_off = cp->buf_len = 0;
+    return 1;
+}
+
+/*
+ * ev_whole: true if the copy of a response kept in object, with a header
+ *           of hdr_len bytes parsed into resp, ends where its framing
+ *           says, nothing missing and nothing after. The server closing
+ *           ends only a response with no other framing.
+ */
+static int ev_whole(chain_t *object, http_resp *resp, size_t hdr_len)
+{
+    http_body body;
+    chain_seg *seg;
+    size_t off = hdr_len, fed = 0;
+
+    http_body_init(&body, resp);
+    for (seg = object->head; seg != NULL && !body.done && !body.bad;
+         seg = seg->next)
+    {
+        if (off < seg->len)
+        {
+            fed += http_body_feed(&body, seg->data + off, seg->len - off);
+        }
+        off = off < seg->len ? 0 : off - seg->len;
+    }
+    return !body.bad && (body.done || body.mode == BODY_EOF)
+           && hdr_len + fed == object->len;
+}
+
+/* ev_finish: the server closed and everything was sent */
+static void ev_finish(loop_t *lp, conn_t *cp)
+{
+    cache_meta meta;
+    http_resp resp;
+    time_t now = time(NULL);
+    int hdr_len;
+
+    metrics_latency(LATENCY_MISS, cp->start);
+
+    /* The response is stored as the server sent it, if its header, in
+     * the first segment, lets it be cached, and the server closing did
+     * not cut its body short */
+    if (cp->keep && cp->object.head != NULL
+        && (hdr_len = http_resp_parse(&resp, cp->object.head->data,
+                                      cp->object.head->len)) > 0
+        && http_storable(&resp, &cp->hreq)
+        && ev_whole(&cp->object, &resp, hdr_len))
+    {
+        memset(&meta, 0, sizeof(meta));
+        meta.hdr_len = -1;
+        meta.framed = 0;
+        meta.lifetime = http_lifetime(&resp, now);
+        meta.expires = now + meta.lifetime;
+        meta.revalidate = resp.no_cache || resp.must_revalidate;
+        strcpy(meta.etag, resp.etag);
+        strcpy(meta.last_modified, resp.last_modified);
+        cache_insert(cp->uri, cp->hash, &cp->object, &meta);
+    }
+    conn_close(lp, cp);
+}
+
+/*
+ * ev_relay: move bytes from server to client. While the client cannot
+ *           take more, stop reading from the server, and only its
+ *           deadline is left to time the response out.
+ */
+static void ev_relay(loop_t *lp, conn_t *cp)
+{
+    ssize_t n;
+
+    if (!ev_flush(lp, cp))
+    {
+        if (!cp->closed)
+        {
+            ev_watch(lp, &cp->server, 0);
+            ev_watch(lp, &cp->client, EPOLLOUT);
+            timer_start(lp, cp, 0);
+        }
+        return;
+    }
+    if (cp->server_eof)
+    {
+        ev_finish(lp, cp);
+        return;
+    }
+
+    if (cp->buf == NULL)
+    {
+        cp->buf = slab_alloc(&relay_slab);
+    }
+    n = read(cp->server.fd, cp->buf, EV_BUFSIZE);
+    if (n < 0)
+    {
+        if (errno != EAGAIN && errno != EINTR)
+        {
+            conn_close(lp, cp);
+            return;
+        }
+        n = 0;
+    }
+    else if (n == 0)
+    {
+        cp->server_eof = 1;
+        ev_finish(lp, cp);
+        return;
+    }
+    cp->buf_len = n;
+
+    /* Keep a copy while the object still fits */
+    if (cp->keep)
+    {
+        if (cp->object.len + n <= cache_max_object)
+        {
+            chain_append(&cp->object, cp->buf, n);
+        }
+        else
+        {
+            chain_free(&cp->object);
+            cp->keep = 0;
+        }
+    }
+
+    if (!ev_flush(lp, cp))
+    {
+        if (!cp->closed)
+        {
+            ev_watch(lp, &cp->server, 0);
+            ev_watch(lp, &cp->client, EPOLLOUT);
+            timer_start(lp, cp, 0);
+        }
+        return;
+    }
+    ev_watch(lp, &cp->client, 0);
+    ev_watch(lp, &cp->server, EPOLLIN);
+    timer_start(lp, cp, read_timeout_ms);
+}
+
+/*
+ * ev_timeout: the server took too long. Unless part of the response went
+ *             out, the client gets our 504, sent like a cache hit.
+ */
+static void ev_timeout(loop_t *lp, conn_t *cp, long now)
+{
+    /* An idle tunnel is not the server's fault */
+    if (cp->state == EV_TUNNEL)
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    if (now >= cp->deadline)
+    {
+        metrics_count(METRIC_TIMEOUTS_TOTAL, 1);
+    }
+    else if (cp->state == EV_RESOLVE || cp->state == EV_CONNECT)
+    {
+        metrics_count(METRIC_TIMEOUTS_CONNECT, 1);
+    }
+    else
+    {
+        metrics_count(METRIC_TIMEOUTS_READ, 1);
+    }
+    if (cp->sent)
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    if (cp->server.fd >= 0)
+    {
+        Close(cp->server.fd);
+        cp->server.fd = -1;
+    }
+    chain_free(&cp->object);
+    cp->keep = 0;
+    cp->hit_iov[0].iov_base = (void *)gateway_timeout;
+    cp->hit_iov[0].iov_len = strlen(gateway_timeout);
+    cp->hit_iovcnt = 1;
+    cp->hit_next = cp->hit_iov;
+    cp->state = EV_HIT;
+    ev_watch(lp, &cp->client, EPOLLOUT);
+}
+
+/* ev_expire: time out the connections due in the ticks gone by */
+static void ev_expire(loop_t *lp)
+{
+    long now = ev_now(), at;
+    conn_t *cp, *next;
+
+    for (; lp->timers > 0 && lp->tick <= now / EV_TICK_MS; lp->tick++)
+    {
+        for (cp = lp->wheel[lp->tick % EV_SLOTS]; cp != NULL; cp = next)
+        {
+            next = cp->timer_next;
+            at = cp->timer;
+            timer_stop(lp, cp);
+            if (at <= now)
+            {
+                ev_timeout(lp, cp, now);
+            }
+            else
+            {
+                timer_file(lp, cp, at);
+            }
+        }
+    }
+}
+
+/* ev_handle: dispatch one event to the connection's state */
+static void ev_handle(loop_t *lp, endpoint_t *ep, unsigned events)
+{
+    conn_t *cp = ep->conn;
+
+    if (cp->closed)
+    {
+        return;
+    }
+    /* A server that closed still has data to read */
+    if ((events & EPOLLERR)
+        || ((events & EPOLLHUP) && !(events & EPOLLIN)
+            && !(ep == &cp->server && cp->state == EV_CONNECT)))
+    {
+        conn_close(lp, cp);
+        return;
+    }
+    switch (cp->state)
+    {
+    case EV_REQUEST:
+        ev_request(lp, cp);
+        break;
+    case EV_HIT:
+        ev_hit(lp, cp);
+        break;
+    case EV_DISK:
+        ev_disk(lp, cp);
+        break;
+    case EV_CONNECT:
+    case EV_SEND:
+        ev_send(lp, cp);
+        break;
+    case EV_RELAY:
+        ev_relay(lp, cp);
+        break;
+    case EV_UPLOAD:
+        ev_upload(lp, cp);
+        break;
+    case EV_TUNNEL:
+        ev_tunnel(lp, cp);
+        break;
+    }
+}
+
+/* conn_close: close both sockets, free the connection after the batch */
+static void conn_close(loop_t *lp, conn_t *cp)
+{
+    if (cp->closed)
+    {
+        return;
+    }
+    cp->closed = 1;
+    timer_stop(lp, cp);
+    Close(cp->client.fd);
+    if (cp->server.fd >= 0)
+    {
+        Close(cp->server.fd);
+    }
+    cp->next_dead = lp->dead;
+    lp->dead = cp;
+}
+
+/* conn_free: release what a closed connection still holds */
+static void conn_free(conn_t *cp)
+{
+    chain_free(&cp->object);
+    if (cp->stats != NULL)
+    {
+        Free(cp->stats);
+    }
+    if (cp->dhit.seg != NULL)
+    {
+        disk_put(&cp->dhit);
+    }
+    if (cp->hit != NULL)
+    {
+        cache_put(cp->hit);
+    }
+    if (cp->tunneling)
+    {
+        tunnel_close(&cp->tun[0]);
+        tunnel_close(&cp->tun[1]);
+    }
+    ev_buf_put(cp->req, cp->req_cap);
+    if (cp->uri != NULL)
+    {
+        ev_buf_put(cp->uri, cp->uri_cap);
+    }
+    if (cp->buf != NULL)
+    {
+        slab_free(&relay_slab, cp->buf);
+    }
+    slab_free(&conn_slab, cp);
+}
+
+/* ev_wake: continue the connections whose name got resolved */
+static void ev_wake(loop_t *lp)
+{
+    uint64_t count;
+    conn_t *cp, *next;
+
+    if (read(lp->wake.fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+    {
+        unix_error("eventfd read error");
+    }
+    pthread_mutex_lock(&lp->ready_lock);
+    cp = lp->ready;
+    lp->ready = NULL;
+    pthread_mutex_unlock(&lp->ready_lock);
+
+    for (; cp != NULL; cp = next)
+    {
+        next = cp->next_ready;
+        cp->resolving = 0;
+        /* One that timed out meanwhile is already sending its 504 */
+        if (cp->closed)
+        {
+            conn_free(cp);
+        }
+        else if (cp->state == EV_RESOLVE)
+        {
+            ev_resolve(lp, cp);
+        }
+    }
+}
+
+/* loop_thread: run one event loop forever */
+static void *loop_thread(void *vargp)
+{
+    loop_t *lp = (loop_t *)vargp;
+    struct epoll_event events[EV_MAXEVENTS];
+    int i, n;
+    conn_t *cp;
+
+    if (lp->pin)
+    {
+        affinity_pin(lp->id);
+    }
+    while (1)
+    {
+        n = epoll_wait(lp->epfd, events, EV_MAXEVENTS,
+                       lp->timers > 0 ? EV_TICK_MS : -1);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            unix_error("epoll_wait error");
+        }
+        for (i = 0; i < n; i++)
+        {
+            endpoint_t *ep = (endpoint_t *)events[i].data.ptr;
+            if (ep == &lp->listen)
+            {
+                ev_accept(lp);
+            }
+            else if (ep == &lp->wake)
+            {
+                ev_wake(lp);
+            }
+            else
+            {
+                ev_handle(lp, ep, events[i].events);
+            }
+        }
+        ev_expire(lp);
+        /* A connection still waiting for a resolver is freed by ev_wake */
+        while ((cp = lp->dead) != NULL)
+        {
+            lp->dead = cp->next_dead;
+            if (!cp->resolving)
+            {
+                conn_free(cp);
+            }
+        }
+    }
+    return NULL;
+}
+
+/*
+ * event_run: start nthreads event loops on the nlisten listening sockets
+ *            of listenfds and wait for them.
+ */
+void event_run(int *listenfds, int nlisten, int nthreads)
+{
+    int i;
+    loop_t *loops;
+    pthread_t *tids;
+
+    for (i = 0; i < nlisten; i++)
+    {
+        if (set_nonblock(listenfds[i]) < 0)
+        {
+            unix_error("fcntl error");
+        }
+    }
+    slab_init(&conn_slab, sizeof(conn_t));
+    slab_init(&small_slab, EV_SMALL);
+    slab_init(&line_slab, MAXLINE);
+    slab_init(&relay_slab, EV_BUFSIZE);
+    loops = Calloc(nthreads, sizeof(loop_t));
+    tids = Calloc(nthreads, sizeof(pthread_t));
+    for (i = 0; i < nthreads; i++)
+    {
+        if ((loops[i].epfd = epoll_create1(0)) < 0)
+        {
+            unix_error("epoll_create1 error");
+        }
+        loops[i].id = i;
+        loops[i].pin = nlisten > 1;
+        loops[i].listen.fd = listenfds[i % nlisten];
+        if (ev_add(&loops[i], &loops[i].listen, EPOLLIN | EPOLLEXCLUSIVE) < 0)
+        {
+            unix_error("epoll_ctl error");
+        }
+        if ((loops[i].wake.fd = eventfd(0, EFD_NONBLOCK)) < 0
+            || ev_add(&loops[i], &loops[i].wake, EPOLLIN) < 0)
+        {
+            unix_error("eventfd error");
+        }
+        pthread_mutex_init(&loops[i].ready_lock, NULL);
+        Pthread_create(&tids[i], NULL, loop_thread, &loops[i]);
+    }
+    for (i = 0; i < nthreads; i++)
+    {
+        Pthread_join(tids[i], NULL);
+    }
+    Free(tids);
+    Free(loops);
+}
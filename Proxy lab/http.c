@@ -0,0 +1,830 @@
+/*
+ * http.c - HTTP/1.1 request parsing and response framing.
+ *
+ * To keep a server connection open after a response, the proxy must
+ * know exactly where the response ends. http_resp_line collects the
+ * header fields that decide this, and http_body_feed follows the body
+ * byte by byte (Content-Length or chunked coding), so the bytes can
+ * still be relayed to the client unchanged. The same header fields say
+ * whether the response may be cached and for how long (RFC 9111).
+ *
+ * Requests are parsed in place by http_req_parse, a line at a time as
+ * they arrive: the request line and each field are recorded as slices
+ * of the buffer they were read into, so the fields passed on to the
+ * server can be written straight from there. A request body is followed
+ * with the same http_body as a response body.
+ */
+#include "http.h"
+#include <limits.h>
+
+/* Positions inside chunked coding */
+#define CH_SIZE     0   /* chunk size digits */
+#define CH_EXT      1   /* chunk extension, up to end of line */
+#define CH_DATA     2   /* chunk data */
+#define CH_DATA_END 3   /* CRLF after chunk data */
+#define CH_TRAILER  4   /* trailer fields after the last chunk */
+
+/* http_resp_init: nothing seen yet */
+void http_resp_init(http_resp *r)
+{
+    r->version = 10;
+    r->status = 0;
+    r->content_length = -1;
+    r->chunked = 0;
+    r->keep_alive = 0;
+    r->no_store = 0;
+    r->no_cache = 0;
+    r->shared = 0;
+    r->must_revalidate = 0;
+    r->max_age = -1;
+    r->s_maxage = -1;
+    r->age = 0;
+    r->date = 0;
+    r->expires = 0;
+    r->etag[0] = '\0';
+    r->last_modified[0] = '\0';
+    r->vary = 0;
+}
+
+/* header_is: true if line is a field called name (case-insensitive) */
+static int header_is(char *line, char *name)
+{
+    size_t len = strlen(name);
+    return !strncasecmp(line, name, len) && line[len] == ':';
+}
+
+/* header_value: the value of a field, leading blanks skipped */
+static char *header_value(char *line)
+{
+    char *v = strchr(line, ':') + 1;
+    while (*v == ' ' || *v == '\t')
+    {
+        v++;
+    }
+    return v;
+}
+
+/* has_token: true if value contains token (case-insensitive) */
+static int has_token(char *value, char *token)
+{
+    size_t len = strlen(token);
+    for (; *value; value++)
+    {
+        if (!strncasecmp(value, token, len))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* copy_value: keep the value of line in out, empty if it is too long */
+static void copy_value(char *out, char *line)
+{
+    char *v = header_value(line);
+    size_t len = strcspn(v, "\r\n");
+
+    if (len >= HTTP_VALIDATOR_LEN)
+    {
+        len = 0;
+    }
+    memcpy(out, v, len);
+    out[len] = '\0';
+}
+
+/* cache_control: note the Cache-Control directives we act on */
+static void cache_control(http_resp *r, char *v)
+{
+    while (*v)
+    {
+        while (*v == ' ' || *v == '\t' || *v == ',')
+        {
+            v++;
+        }
+        if (!strncasecmp(v, "no-store", 8) || !strncasecmp(v, "private", 7))
+        {
+            r->no_store = 1;
+        }
+        else if (!strncasecmp(v, "no-cache", 8))
+        {
+            r->no_cache = 1;
+        }
+        else if (!strncasecmp(v, "s-maxage=", 9))
+        {
+            r->s_maxage = strtol(v + 9, NULL, 10);
+            r->shared = 1;
+        }
+        else if (!strncasecmp(v, "must-revalidate", 15))
+        {
+            r->must_revalidate = 1;
+            r->shared = 1;
+        }
+        else if (!strncasecmp(v, "proxy-revalidate", 16))
+        {
+            r->must_revalidate = 1;
+        }
+        else if (!strncasecmp(v, "public", 6))
+        {
+            r->shared = 1;
+        }
+        else if (!strncasecmp(v, "max-age=", 8))
+        {
+            r->max_age = strtol(v + 8, NULL, 10);
+        }
+        if ((v = strchr(v, ',')) == NULL)
+        {
+            break;
+        }
+    }
+}
+
+/*
+ * http_resp_line: feed one line of the response header, the status line
+ *                 first. Return -1 if the status line is malformed.
+ */
+int http_resp_line(http_resp *r, char *line, int first)
+{
+    int minor;
+
+    if (first)
+    {
+        if (sscanf(line, "HTTP/1.%d %d", &minor, &r->status) != 2)
+        {
+            return -1;
+        }
+        r->version = minor >= 1 ? 11 : 10;
+        r->keep_alive = (r->version == 11);
+        return 0;
+    }
+    if (header_is(line, "Content-Length"))
+    {
+        r->content_length = strtol(header_value(line), NULL, 10);
+    }
+    else if (header_is(line, "Transfer-Encoding"))
+    {
+        r->chunked = (has_token(header_value(line), "chunked"));
+    }
+    else if (header_is(line, "Cache-Control"))
+    {
+        cache_control(r, header_value(line));
+    }
+    else if (header_is(line, "Pragma"))
+    {
+        r->no_cache |= has_token(header_value(line), "no-cache");
+    }
+    else if (header_is(line, "Expires"))
+    {
+        if ((r->expires = http_date(header_value(line))) == 0)
+        {
+            r->expires = 1;
+        }
+    }
+    else if (header_is(line, "Date"))
+    {
+        r->date = http_date(header_value(line));
+    }
+    else if (header_is(line, "Age"))
+    {
+        r->age = strtol(header_value(line), NULL, 10);
+    }
+    else if (header_is(line, "ETag"))
+    {
+        copy_value(r->etag, line);
+    }
+    else if (header_is(line, "Last-Modified"))
+    {
+        copy_value(r->last_modified, line);
+    }
+    else if (header_is(line, "Vary"))
+    {
+        r->vary = strcspn(header_value(line), "\r\n") > 0;
+    }
+    else
+    {
+        r->keep_alive = http_keep_alive(line, r->keep_alive);
+    }
+    return 0;
+}
+
+/*
+ * http_keep_alive: update keep_alive from line if it is a Connection or
+ *                  Proxy-Connection field, else return it unchanged.
+ */
+int http_keep_alive(char *line, int keep_alive)
+{
+    char *v;
+
+    if (!header_is(line, "Connection") && !header_is(line, "Proxy-Connection"))
+    {
+        return keep_alive;
+    }
+    v = header_value(line);
+    if (has_token(v, "close"))
+    {
+        return 0;
+    }
+    if (has_token(v, "keep-alive"))
+    {
+        return 1;
+    }
+    return keep_alive;
+}
+
+/*
+ * http_resp_parse: parse a whole response header held in buf. Return
+ *                  its length up to the blank line included, or -1 if
+ *                  it is malformed or does not end within n bytes.
+ */
+int http_resp_parse(http_resp *r, const char *buf, size_t n)
+{
+    char line[MAXLINE];
+    const char *p = buf, *eol;
+    size_t len;
+    int first = 1;
+
+    http_resp_init(r);
+    while ((eol = memchr(p, '\n', n - (p - buf))) != NULL)
+    {
+        len = eol - p + 1;
+        if (len >= MAXLINE)
+        {
+            return -1;
+        }
+        memcpy(line, p, len);
+        line[len] = '\0';
+        p = eol + 1;
+        if (!first && (!strcmp(line, "\r\n") || !strcmp(line, "\n")))
+        {
+            return p - buf;
+        }
+        if (http_resp_line(r, line, first) < 0)
+        {
+            return -1;
+        }
+        first = 0;
+    }
+    return -1;
+}
+
+/* slice_is: true if slice s of buf is name (case-insensitive) */
+static int slice_is(const char *buf, http_slice s, const char *name)
+{
+    return (size_t)s.len == strlen(name)
+           && !strncasecmp(buf + s.off, name, s.len);
+}
+
+/* slice_has_token: true if slice s of buf contains token */
+static int slice_has_token(const char *buf, http_slice s, const char *token)
+{
+    int len = strlen(token), i;
+
+    for (i = 0; i + len <= s.len; i++)
+    {
+        if (!strncasecmp(buf + s.off + i, token, len))
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* http_req_init: nothing read yet */
+void http_req_init(http_req *r)
+{
+    r->pos = 0;
+    r->hdr_len = 0;
+    r->method.len = 0;
+    r->nfields = 0;
+    r->keep_alive = 0;
+    r->content_length = -1;
+    r->chunked = 0;
+    r->transfer_encoding = 0;
+    r->bad_length = 0;
+    r->expect_continue = 0;
+    r->credentials = 0;
+}
+
+/* method_kind: which of HTTP_GET and so on the method in s of buf is */
+static int method_kind(const char *buf, http_slice s)
+{
+    static const char *names[] = { "GET", "HEAD", "CONNECT" };
+    int k;
+
+    /* Methods are case-sensitive, unlike field names */
+    for (k = 0; k < 3; k++)
+    {
+        if ((size_t)s.len == strlen(names[k])
+            && !strncmp(buf + s.off, names[k], s.len))
+        {
+            return k;
+        }
+    }
+    return HTTP_OTHER;
+}
+
+/*
+ * req_line: split the request line, len bytes of buf from start without
+ *           the end of line, into method, uri and version. Return -1 if
+ *           it is not a request line.
+ */
+static int req_line(http_req *r, const char *buf, int start, int len)
+{
+    http_slice *part[3] = { &r->method, &r->uri, &r->version };
+    int i = start, end = start + len, k;
+
+    for (k = 0; k < 3; k++)
+    {
+        while (i < end && buf[i] == ' ')
+        {
+            i++;
+        }
+        part[k]->off = i;
+        while (i < end && buf[i] != ' ')
+        {
+            i++;
+        }
+        if ((part[k]->len = i - part[k]->off) == 0)
+        {
+            return -1;
+        }
+    }
+    if (i != end || r->version.len != 8
+        || strncmp(buf + r->version.off, "HTTP/1.", 7))
+    {
+        r->method.len = 0;
+        return -1;
+    }
+    r->keep_alive = (buf[r->version.off + 7] != '0');
+    r->kind = method_kind(buf, r->method);
+    return 0;
+}
+
+/*
+ * req_field: take a field line, len bytes of buf from start without the
+ *            end of line, which takes line_len bytes with it. Return -1
+ *            if it is malformed or one too many.
+ */
+static int req_field(http_req *r, const char *buf, int start, int len,
+                     int line_len)
+{
+    const char *colon = memchr(buf + start, ':', len);
+    char *num_end;
+    long length;
+    http_field *f;
+    int v, end = start + len;
+
+    /* No blank may come before the colon, or a server could read
+     * another field than we did */
+    if (colon == NULL || colon == buf + start
+        || r->nfields == HTTP_MAX_FIELDS
+        || memchr(buf + start, ' ', colon - (buf + start))
+        || memchr(buf + start, '\t', colon - (buf + start)))
+    {
+        return -1;
+    }
+    f = &r->field[r->nfields++];
+    f->line.off = start;
+    f->line.len = line_len;
+    f->name.off = start;
+    f->name.len = colon - (buf + start);
+    for (v = colon - buf + 1; v < end && (buf[v] == ' ' || buf[v] == '\t');
+         v++)
+    {
+        ;
+    }
+    while (end > v && (buf[end - 1] == ' ' || buf[end - 1] == '\t'))
+    {
+        end--;
+    }
+    f->value.off = v;
+    f->value.len = end - v;
+
+    if (slice_is(buf, f->name, "Connection")
+        || slice_is(buf, f->name, "Proxy-Connection"))
+    {
+        if (slice_has_token(buf, f->value, "close"))
+        {
+            r->keep_alive = 0;
+        }
+        else if (slice_has_token(buf, f->value, "keep-alive"))
+        {
+            r->keep_alive = 1;
+        }
+    }
+    else if (slice_is(buf, f->name, "Content-Length"))
+    {
+        length = strtol(buf + v, &num_end, 10);
+        if (f->value.len == 0 || num_end != buf + end || length < 0
+            || (r->content_length >= 0 && length != r->content_length))
+        {
+            r->bad_length = 1;
+        }
+        r->content_length = length;
+    }
+    else if (slice_is(buf, f->name, "Transfer-Encoding"))
+    {
+        r->transfer_encoding = 1;
+        r->chunked = slice_has_token(buf, f->value, "chunked");
+    }
+    else if (slice_is(buf, f->name, "Authorization")
+             || slice_is(buf, f->name, "Cookie"))
+    {
+        r->credentials = 1;
+    }
+    else if (slice_is(buf, f->name, "Expect"))
+    {
+        r->expect_continue = slice_has_token(buf, f->value, "100-continue");
+    }
+    return 0;
+}
+
+/*
+ * http_req_parse: parse what is new in the first n bytes of buf, which
+ *                 grow as the request arrives. Return 1 once the header
+ *                 is whole, r->hdr_len bytes long, 0 while more is
+ *                 needed, -1 if it is malformed.
+ */
+int http_req_parse(http_req *r, const char *buf, size_t n)
+{
+    const char *eol;
+    int start, len;
+
+    while ((size_t)r->pos < n
+           && (eol = memchr(buf + r->pos, '\n', n - r->pos)) != NULL)
+    {
+        start = r->pos;
+        r->pos = eol - buf + 1;
+        len = r->pos - start - 1;
+        if (len > 0 && buf[start + len - 1] == '\r')
+        {
+            len--;
+        }
+        /* Blank lines before the request line are skipped */
+        if (r->method.len == 0)
+        {
+            if (len > 0 && req_line(r, buf, start, len) < 0)
+            {
+                return -1;
+            }
+        }
+        else if (len == 0)
+        {
+            r->hdr_len = r->pos;
+            return 1;
+        }
+        else if (req_field(r, buf, start, len, r->pos - start) < 0)
+        {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * http_req_forwards: true if field i of the request in buf is passed on
+ *                    to the server. The proxy writes Host, User-Agent and
+ *                    Connection itself, answers Expect itself, and
+ *                    hop-by-hop fields stop here. For a GET, so do
+ *                    conditional and range fields, and the framing of a
+ *                    body, which is not passed on: the response is cached
+ *                    and shared with every client of the uri, so it must
+ *                    be the whole, current one. Credentials do go on,
+ *                    and then keep the response out of the cache unless
+ *                    it allows it (see http_storable). Other methods are
+ *                    passed on as they are, body included.
+ */
+int http_req_forwards(http_req *r, const char *buf, int i)
+{
+    static const char *dropped[] = {
+        "Host", "User-Agent", "Connection", "Proxy-Connection",
+        "Keep-Alive", "TE", "Trailer", "Upgrade", "Proxy-Authorization",
+        "Expect", NULL
+    };
+    static const char *dropped_get[] = {
+        "If-None-Match", "If-Modified-Since", "If-Range", "Range",
+        "Content-Length", "Transfer-Encoding", NULL
+    };
+    const char **d;
+
+    for (d = dropped; *d != NULL; d++)
+    {
+        if (slice_is(buf, r->field[i].name, *d))
+        {
+            return 0;
+        }
+    }
+    for (d = dropped_get; r->kind == HTTP_GET && *d != NULL; d++)
+    {
+        if (slice_is(buf, r->field[i].name, *d))
+        {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * http_req_framing_ok: false if the body of the request could be read
+ *                      two ways, by us and by a server: Content-Length
+ *                      with Transfer-Encoding, a coding other than
+ *                      chunked, or lengths that do not agree. Nor may a
+ *                      GET have a body, as its framing is not passed
+ *                      on. Such a request gets a 400 (RFC 9112, 6.1).
+ */
+int http_req_framing_ok(http_req *r)
+{
+    if (r->bad_length
+        || (r->transfer_encoding && (!r->chunked || r->content_length >= 0)))
+    {
+        return 0;
+    }
+    return r->kind != HTTP_GET
+           || (!r->transfer_encoding && r->content_length <= 0);
+}
+
+/*
+ * http_date: parse an HTTP date such as "Sun, 06 Nov 1994 08:49:37 GMT".
+ *            Return 0 if it is not one.
+ */
+time_t http_date(const char *value)
+{
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char mon[4];
+    const char *m;
+    struct tm tm;
+
+    memset(&tm, 0, sizeof(tm));
+    if (sscanf(value, "%*[^,], %d %3s %d %d:%d:%d", &tm.tm_mday, mon,
+               &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec) != 6
+        || strlen(mon) != 3 || (m = strstr(months, mon)) == NULL
+        || (m - months) % 3 != 0)
+    {
+        return 0;
+    }
+    tm.tm_mon = (m - months) / 3;
+    tm.tm_year -= 1900;
+    return timegm(&tm);
+}
+
+/*
+ * http_cacheable: true if a shared cache may store the response, for a
+ *                 status cacheable by default. Lines are keyed on the
+ *                 uri alone, so a response that varies on request
+ *                 fields is not stored.
+ */
+int http_cacheable(http_resp *r)
+{
+    switch (r->status)
+    {
+    case 200: case 203: case 204: case 300: case 301: case 404: case 410:
+        return http_shareable(r);
+    default:
+        return 0;
+    }
+}
+
+/*
+ * http_shareable: true if the response may go to other clients than the
+ *                 one it was fetched for, whatever its status: it is not
+ *                 private or no-store, and does not vary on request
+ *                 fields.
+ */
+int http_shareable(http_resp *r)
+{
+    return !r->no_store && !r->vary;
+}
+
+/*
+ * http_storable: true if the response r to request q may be stored and
+ *                sent to other clients. A request with credentials may
+ *                get a response for its client alone, which is only
+ *                shared if it says so (RFC 9111, 3.5). q may be NULL
+ *                for a request of the proxy's own.
+ */
+int http_storable(http_resp *r, http_req *q)
+{
+    return http_cacheable(r) && (q == NULL || !q->credentials || r->shared);
+}
+
+/* http_has_freshness: true if the response says how long it stays fresh */
+int http_has_freshness(http_resp *r)
+{
+    return r->no_cache || r->s_maxage >= 0 || r->max_age >= 0 || r->expires;
+}
+
+/*
+ * http_lifetime: how many seconds from now a response received now
+ *                stays fresh. Without explicit freshness, a tenth of the
+ *                time since Last-Modified is used, as RFC 9111 suggests.
+ */
+long http_lifetime(http_resp *r, time_t now)
+{
+    time_t date = r->date ? r->date : now;
+    time_t modified;
+    long lifetime;
+
+    if (r->no_cache)
+    {
+        return 0;
+    }
+    if (r->s_maxage >= 0)
+    {
+        lifetime = r->s_maxage;
+    }
+    else if (r->max_age >= 0)
+    {
+        lifetime = r->max_age;
+    }
+    else if (r->expires)
+    {
+        lifetime = r->expires - date;
+    }
+    else if ((modified = http_date(r->last_modified)) != 0)
+    {
+        lifetime = (date - modified) / 10;
+        if (lifetime > HTTP_MAX_HEURISTIC)
+        {
+            lifetime = HTTP_MAX_HEURISTIC;
+        }
+    }
+    else
+    {
+        lifetime = HTTP_DEFAULT_TTL;
+    }
+    lifetime -= r->age;
+    return lifetime > 0 ? lifetime : 0;
+}
+
+/*
+ * http_is_hop_header: true for fields that only describe one connection
+ *                     and must not be passed on.
+ */
+int http_is_hop_header(char *line)
+{
+    return header_is(line, "Connection")
+        || header_is(line, "Keep-Alive")
+        || header_is(line, "Proxy-Connection");
+}
+
+/* http_body_init: choose how the body of response r is delimited */
+void http_body_init(http_body *b, http_resp *r)
+{
+    b->state = CH_SIZE;
+    b->remaining = 0;
+    b->line_empty = 1;
+    b->done = 0;
+    b->bad = 0;
+
+    if ((r->status >= 100 && r->status < 200) || r->status == 204
+        || r->status == 304)
+    {
+        b->mode = BODY_NONE;
+        b->done = 1;
+    }
+    else if (r->chunked)
+    {
+        b->mode = BODY_CHUNKED;
+    }
+    else if (r->content_length >= 0)
+    {
+        b->mode = BODY_LENGTH;
+        b->remaining = r->content_length;
+        b->done = (b->remaining == 0);
+    }
+    else
+    {
+        b->mode = BODY_EOF;
+    }
+}
+
+/*
+ * http_req_body_init: follow the body of request r. A request says how
+ *                     long its body is, one that does not has none.
+ */
+void http_req_body_init(http_body *b, http_req *r)
+{
+    b->state = CH_SIZE;
+    b->remaining = 0;
+    b->line_empty = 1;
+    b->done = 0;
+    b->bad = 0;
+
+    if (r->chunked)
+    {
+        b->mode = BODY_CHUNKED;
+    }
+    else if (r->content_length > 0)
+    {
+        b->mode = BODY_LENGTH;
+        b->remaining = r->content_length;
+    }
+    else
+    {
+        b->mode = BODY_NONE;
+        b->done = 1;
+    }
+}
+
+/* hex_digit: value of a hex digit, -1 if it is not one */
+static int hex_digit(char ch)
+{
+    if (ch >= '0' && ch <= '9')
+        return ch - '0';
+    if (ch >= 'a' && ch <= 'f')
+        return ch - 'a' + 10;
+    if (ch >= 'A' && ch <= 'F')
+        return ch - 'A' + 10;
+    return -1;
+}
+
+/*
+ * http_body_feed: follow n more body bytes, return how many of them
+ *                 belong to this response. b->done is set at the end,
+ *                 b->bad if a chunk size does not fit in a long; no more
+ *                 bytes are taken after that.
+ */
+size_t http_body_feed(http_body *b, const char *buf, size_t n)
+{
+    size_t i = 0, take;
+    int d;
+
+    switch (b->mode)
+    {
+    case BODY_NONE:
+        return 0;
+    case BODY_EOF:
+        return n;
+    case BODY_LENGTH:
+        take = (size_t)b->remaining < n ? (size_t)b->remaining : n;
+        b->remaining -= take;
+        b->done = (b->remaining == 0);
+        return take;
+    }
+
+    /* BODY_CHUNKED */
+    while (i < n && !b->done && !b->bad)
+    {
+        switch (b->state)
+        {
+        case CH_SIZE:
+            if (buf[i] == '\n')
+            {
+                b->state = b->remaining > 0 ? CH_DATA : CH_TRAILER;
+                b->line_empty = 1;
+            }
+            else if ((d = hex_digit(buf[i])) >= 0)
+            {
+                if (b->remaining > (LONG_MAX - d) / 16)
+                {
+                    b->bad = 1;
+                    break;
+                }
+                b->remaining = b->remaining * 16 + d;
+            }
+            else if (buf[i] != '\r')
+            {
+                b->state = CH_EXT;
+            }
+            i++;
+            break;
+        case CH_EXT:
+            if (buf[i++] == '\n')
+            {
+                b->state = b->remaining > 0 ? CH_DATA : CH_TRAILER;
+                b->line_empty = 1;
+            }
+            break;
+        case CH_DATA:
+            take = (size_t)b->remaining < n - i ? (size_t)b->remaining : n - i;
+            b->remaining -= take;
+            i += take;
+            if (b->remaining == 0)
+            {
+                b->state = CH_DATA_END;
+            }
+            break;
+        case CH_DATA_END:
+            if (buf[i++] == '\n')
+            {
+                b->state = CH_SIZE;
+            }
+            break;
+        case CH_TRAILER:
+            if (buf[i] == '\n')
+            {
+                if (b->line_empty)
+                {
+                    b->done = 1;
+                }
+                b->line_empty = 1;
+            }
+            else if (buf[i] != '\r')
+            {
+                b->line_empty = 0;
+            }
+            i++;
+            break;
+        }
+    }
+    return i;
+}
@@ -0,0 +1,127 @@
+#ifndef HTTP_H
+#define HTTP_H
+#include "csapp.h"
+
+/* How the end of a response body is found */
+#define BODY_NONE    0   /* no body (204, 304, 1xx) */
+#define BODY_LENGTH  1   /* Content-Length bytes */
+#define BODY_CHUNKED 2   /* chunked transfer coding */
+#define BODY_EOF     3   /* until the server closes */
+
+/* Requests */
+#define HTTP_MAX_FIELDS     64      /* Header fields taken per request */
+
+/* Methods, as far as the proxy treats them apart */
+#define HTTP_GET     0   /* may be cached */
+#define HTTP_HEAD    1   /* passed on, its response has no body */
+#define HTTP_CONNECT 2   /* tunnelled */
+#define HTTP_OTHER   3   /* passed on with its body, never cached */
+
+/* Caching */
+#define HTTP_VALIDATOR_LEN  80      /* Longest ETag or date kept */
+#define HTTP_DEFAULT_TTL    60      /* Freshness with nothing to go on */
+#define HTTP_MAX_HEURISTIC  86400   /* Cap on freshness from Last-Modified */
+
+/* Struct for the interesting parts of a response header */
+typedef struct http_resp http_resp;
+struct http_resp
+{
+    int version;          /* 10 for HTTP/1.0, 11 for HTTP/1.1 */
+    int status;
+    long content_length;  /* -1 if absent */
+    int chunked;
+    int keep_alive;       /* server lets us reuse the connection */
+
+    /* What decides whether and how long the response may be cached */
+    int no_store;         /* no-store or private */
+    int no_cache;         /* only to be used after revalidation */
+    int shared;           /* public, s-maxage or must-revalidate: may be
+                             stored even for a request with credentials */
+    int must_revalidate;  /* must- or proxy-revalidate: never served
+                             stale */
+    long max_age;         /* -1 if absent */
+    long s_maxage;        /* -1 if absent, wins over max-age */
+    long age;
+    time_t date;          /* 0 if absent */
+    time_t expires;       /* 0 if absent, 1 if invalid (already stale) */
+    char etag[HTTP_VALIDATOR_LEN];
+    char last_modified[HTTP_VALIDATOR_LEN];
+    int vary;             /* depends on request fields we do not key on */
+};
+
+/* Struct for a piece of the buffer a request was read into */
+typedef struct http_slice http_slice;
+struct http_slice
+{
+    int off;
+    int len;
+};
+
+/* Struct for a header field of a request */
+typedef struct http_field http_field;
+struct http_field
+{
+    http_slice line;      /* the whole line, end of line included */
+    http_slice name;
+    http_slice value;     /* without the blanks around it */
+};
+
+/* Struct for a request header, parsed in place as it arrives: its parts
+ * are slices of the caller's buffer, nothing is copied */
+typedef struct http_req http_req;
+struct http_req
+{
+    int pos;              /* bytes of the buffer parsed so far */
+    int hdr_len;          /* up to the blank line included, once whole */
+    http_slice method;
+    int kind;             /* HTTP_GET and so on */
+    http_slice uri;
+    http_slice version;
+    int nfields;
+    http_field field[HTTP_MAX_FIELDS];
+    int keep_alive;       /* client wants the connection kept open */
+    long content_length;  /* -1 if absent */
+    int chunked;
+    int transfer_encoding;  /* a Transfer-Encoding field came */
+    int bad_length;       /* Content-Length not a number, or twice with
+                             two values */
+    int expect_continue;  /* client waits for a 100 before the body */
+    int credentials;      /* Authorization or Cookie: the response may be
+                             meant for this client alone */
+};
+
+/* Struct for tracking where a response body ends */
+typedef struct http_body http_body;
+struct http_body
+{
+    int mode;             /* BODY_* */
+    int state;            /* position inside chunked coding */
+    long remaining;       /* bytes left in body or current chunk */
+    int line_empty;       /* current trailer line has no bytes yet */
+    int done;
+    int bad;              /* framing broken, the body cannot be followed */
+};
+
+void http_resp_init(http_resp *r);
+int http_resp_line(http_resp *r, char *line, int first);
+int http_is_hop_header(char *line);
+int http_keep_alive(char *line, int keep_alive);
+int http_resp_parse(http_resp *r, const char *buf, size_t n);
+
+void http_req_init(http_req *r);
+int http_req_parse(http_req *r, const char *buf, size_t n);
+int http_req_forwards(http_req *r, const char *buf, int i);
+int http_req_framing_ok(http_req *r);
+
+time_t http_date(const char *value);
+int http_cacheable(http_resp *r);
+int http_storable(http_resp *r, http_req *q);
+int http_shareable(http_resp *r);
+int http_has_freshness(http_resp *r);
+long http_lifetime(http_resp *r, time_t now);
+
+void http_body_init(http_body *b, http_resp *r);
+void http_req_body_init(http_body *b, http_req *r);
+size_t http_body_feed(http_body *b, const char *buf, size_t n);
+
+#endif
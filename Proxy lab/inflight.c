@@ -0,0 +1,335 @@
+/*
+ * inflight.c - fetch a missed uri once, however many clients want it.
+ *
+ * When several clients miss on the same uri at the same time, only the
+ * first one goes to the server. The others attach to its entry here and
+ * get the response bytes as they arrive, instead of each opening its own
+ * connection and each inserting its own copy into the cache. The bytes
+ * are those the cache would keep: the header without our Connection
+ * field, then the body. A follower can only join while the buffer still
+ * starts at the first byte; past INFLIGHT_MAX_BUF, bytes every follower
+ * has read are dropped and the fetcher waits for the slowest one.
+ *
+ * Only responses any client may get are shared. A request with
+ * credentials fetches alone, and a fetcher whose response turns out to
+ * be private, no-store or varying detaches its followers before they
+ * see any of it; each then fetches the uri itself.
+ */
+#include "inflight.h"
+
+static inflight_t *table[INFLIGHT_BUCKETS];
+static pthread_mutex_t table_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* bucket_of: bucket for a uri with this cache_hash */
+static inflight_t **bucket_of(unsigned hash)
+{
+    return &table[hash % INFLIGHT_BUCKETS];
+}
+
+/* withdraw: take f out of the table so nobody else joins it */
+static void withdraw(inflight_t *f)
+{
+    inflight_t **pp;
+
+    pthread_mutex_lock(&table_lock);
+    if (f->joinable)
+    {
+        for (pp = bucket_of(f->hash); *pp != f; pp = &(*pp)->next)
+        {
+            ;
+        }
+        *pp = f->next;
+        f->joinable = 0;
+    }
+    pthread_mutex_unlock(&table_lock);
+}
+
+/* drop_ref: release one reference, free f with the last one */
+static void drop_ref(inflight_t *f)
+{
+    int last;
+
+    pthread_mutex_lock(&f->lock);
+    last = (--f->refcnt == 0);
+    pthread_mutex_unlock(&f->lock);
+    if (last)
+    {
+        pthread_mutex_destroy(&f->lock);
+        pthread_cond_destroy(&f->cond);
+        Free(f->buf);
+        Free(f);
+    }
+}
+
+/* lowest: stream offset every follower has read up to, f locked */
+static size_t lowest(inflight_t *f)
+{
+    size_t low = f->base + f->len;
+    inflight_reader *r;
+
+    for (r = f->readers; r != NULL; r = r->next)
+    {
+        if (r->off < low)
+        {
+            low = r->off;
+        }
+    }
+    return low;
+}
+
+/* inflight_init: start with nothing in flight */
+void inflight_init()
+{
+    memset(table, 0, sizeof(table));
+}
+
+/*
+ * inflight_join: return 1 if nobody is fetching uri yet. The caller is
+ *                then the fetcher of the new entry *fp and must end it
+ *                with inflight_finish. Otherwise return 0: r follows the
+ *                entry *fp from its first byte until inflight_leave.
+ *                hash is the uri's cache_hash.
+ */
+int inflight_join(char *uri, unsigned hash, inflight_t **fp,
+                  inflight_reader *r)
+{
+    inflight_t **b, *f;
+
+    pthread_mutex_lock(&table_lock);
+    b = bucket_of(hash);
+    for (f = *b; f != NULL; f = f->next)
+    {
+        if (f->hash == hash && !strcmp(f->uri, uri))
+        {
+            pthread_mutex_lock(&f->lock);
+            f->refcnt++;
+            r->f = f;
+            r->off = 0;
+            r->next = f->readers;
+            f->readers = r;
+            pthread_mutex_unlock(&f->lock);
+            pthread_mutex_unlock(&table_lock);
+            *fp = f;
+            return 0;
+        }
+    }
+
+    f = inflight_alone(uri, hash);
+    f->joinable = 1;
+    f->next = *b;
+    *b = f;
+    pthread_mutex_unlock(&table_lock);
+    *fp = f;
+    return 1;
+}
+
+/*
+ * inflight_alone: an entry for a fetch of uri that nobody can join, to
+ *                 be ended with inflight_finish like any other
+ */
+inflight_t *inflight_alone(char *uri, unsigned hash)
+{
+    inflight_t *f = Calloc(1, sizeof(inflight_t));
+
+    strncpy(f->uri, uri, MAXLINE - 1);
+    f->hash = hash;
+    f->state = INFLIGHT_RUNNING;
+    f->refcnt = 1;
+    pthread_mutex_init(&f->lock, NULL);
+    pthread_cond_init(&f->cond, NULL);
+    return f;
+}
+
+/*
+ * inflight_detach: the response is not for sharing. Nobody joins from
+ *                  now on, and the followers, still waiting for the
+ *                  header, are told to fetch on their own. Later calls
+ *                  to pass bytes on do nothing.
+ */
+void inflight_detach(inflight_t *f)
+{
+    if (f == NULL)
+    {
+        return;
+    }
+    withdraw(f);
+    pthread_mutex_lock(&f->lock);
+    f->detached = 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* inflight_header: the header is complete, followers may start sending */
+void inflight_header(inflight_t *f, cache_meta *meta)
+{
+    if (f == NULL || f->detached)
+    {
+        return;
+    }
+    pthread_mutex_lock(&f->lock);
+    f->meta = *meta;
+    f->have_header = 1;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/* inflight_append: pass n more response bytes on to the followers */
+void inflight_append(inflight_t *f, char *buf, size_t n)
+{
+    size_t low, cap;
+
+    if (f == NULL || f->detached)
+    {
+        return;
+    }
+    pthread_mutex_lock(&f->lock);
+    while (f->len + n > f->cap)
+    {
+        /* Nobody will ever read these bytes */
+        if (!f->joinable && f->readers == NULL)
+        {
+            f->base += f->len + n;
+            f->len = 0;
+            pthread_mutex_unlock(&f->lock);
+            return;
+        }
+        if (f->cap < INFLIGHT_MAX_BUF || f->len == 0)
+        {
+            cap = f->cap ? f->cap : RELAY_BUFSIZE;
+            while (cap < f->len + n && cap < INFLIGHT_MAX_BUF)
+            {
+                cap *= 2;
+            }
+            if (cap < f->len + n && f->len == 0)
+            {
+                cap = n;
+            }
+            f->buf = Realloc(f->buf, cap);
+            f->cap = cap;
+            continue;
+        }
+
+        /* Full: the first bytes are about to go, so a new follower
+         * could not start from the beginning any more */
+        if (f->joinable)
+        {
+            pthread_mutex_unlock(&f->lock);
+            withdraw(f);
+            pthread_mutex_lock(&f->lock);
+            continue;
+        }
+        if ((low = lowest(f)) > f->base)
+        {
+            memmove(f->buf, f->buf + (low - f->base),
+                    f->len - (low - f->base));
+            f->len -= low - f->base;
+            f->base = low;
+            continue;
+        }
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    memcpy(f->buf + f->len, buf, n);
+    f->len += n;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+}
+
+/*
+ * inflight_finish: the fetch ended, completely if ok. Later requests go
+ *                  to the cache or fetch again; followers get the rest.
+ */
+void inflight_finish(inflight_t *f, int ok)
+{
+    if (f == NULL)
+    {
+        return;
+    }
+    withdraw(f);
+    pthread_mutex_lock(&f->lock);
+    f->state = ok ? INFLIGHT_DONE : INFLIGHT_FAILED;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    drop_ref(f);
+}
+
+/*
+ * inflight_wait_header: wait until the fetcher has the whole header.
+ *                       Return 0 with *meta filled, 1 if the response
+ *                       is not for sharing, or -1 if the fetch failed
+ *                       before.
+ */
+int inflight_wait_header(inflight_reader *r, cache_meta *meta)
+{
+    inflight_t *f = r->f;
+    int rc = -1;
+
+    pthread_mutex_lock(&f->lock);
+    while (!f->have_header && !f->detached
+           && f->state == INFLIGHT_RUNNING)
+    {
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    if (f->detached)
+    {
+        rc = 1;
+    }
+    else if (f->have_header)
+    {
+        *meta = f->meta;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+/*
+ * inflight_read: copy up to n bytes the follower has not read yet into
+ *                out, waiting for the fetcher if needed. Return their
+ *                count, 0 at the end, or -1 if the fetch failed.
+ */
+ssize_t inflight_read(inflight_reader *r, char *out, size_t n)
+{
+    inflight_t *f = r->f;
+    ssize_t rc;
+
+    pthread_mutex_lock(&f->lock);
+    while (r->off == f->base + f->len && f->state == INFLIGHT_RUNNING)
+    {
+        pthread_cond_wait(&f->cond, &f->lock);
+    }
+    if (r->off < f->base + f->len)
+    {
+        rc = f->base + f->len - r->off;
+        if ((size_t)rc > n)
+        {
+            rc = n;
+        }
+        memcpy(out, f->buf + (r->off - f->base), rc);
+        r->off += rc;
+        /* The fetcher may be waiting for room */
+        pthread_cond_broadcast(&f->cond);
+    }
+    else
+    {
+        rc = (f->state == INFLIGHT_DONE) ? 0 : -1;
+    }
+    pthread_mutex_unlock(&f->lock);
+    return rc;
+}
+
+/* inflight_leave: stop following, whether or not everything was read */
+void inflight_leave(inflight_reader *r)
+{
+    inflight_t *f = r->f;
+    inflight_reader **pp;
+
+    pthread_mutex_lock(&f->lock);
+    for (pp = &f->readers; *pp != r; pp = &(*pp)->next)
+    {
+        ;
+    }
+    *pp = r->next;
+    pthread_cond_broadcast(&f->cond);
+    pthread_mutex_unlock(&f->lock);
+    drop_ref(f);
+}
@@ -0,0 +1,64 @@
+#ifndef INFLIGHT_H
+#define INFLIGHT_H
+#include "cache.h"
+
+#define INFLIGHT_BUCKETS   64
+#define INFLIGHT_MAX_BUF   (1 << 20)   /* Bytes kept for slow followers */
+
+/* Fetch states */
+#define INFLIGHT_RUNNING 0
+#define INFLIGHT_DONE    1
+#define INFLIGHT_FAILED  2
+
+typedef struct inflight inflight_t;
+typedef struct inflight_reader inflight_reader;
+
+/* Struct for a follower reading an in-flight response */
+struct inflight_reader
+{
+    inflight_t *f;
+    size_t off;                /* Stream offset of the next byte to read */
+    inflight_reader *next;
+};
+
+/* Struct for a response being fetched once for several clients */
+struct inflight
+{
+    char uri[MAXLINE];
+    unsigned hash;             /* cache_hash of uri */
+    int joinable;              /* Still in the table, buffer starts at 0 */
+    int detached;              /* Response not for sharing, followers
+                                  fetch on their own */
+    int state;
+    int have_header;
+    cache_meta meta;           /* Same layout as a cached response */
+
+    char *buf;                 /* Bytes from stream offset base on */
+    size_t base;
+    size_t len;
+    size_t cap;
+
+    int refcnt;                /* Fetcher plus followers */
+    inflight_reader *readers;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    inflight_t *next;
+};
+
+void inflight_init();
+int inflight_join(char *uri, unsigned hash, inflight_t **fp,
+                  inflight_reader *r);
+inflight_t *inflight_alone(char *uri, unsigned hash);
+
+/* Fetcher side: f is NULL for a fetch nobody can share */
+void inflight_detach(inflight_t *f);
+void inflight_header(inflight_t *f, cache_meta *meta);
+void inflight_append(inflight_t *f, char *buf, size_t n);
+void inflight_finish(inflight_t *f, int ok);
+
+/* Follower side */
+int inflight_wait_header(inflight_reader *r, cache_meta *meta);
+ssize_t inflight_read(inflight_reader *r, char *out, size_t n);
+void inflight_leave(inflight_reader *r);
+
+#endif
@@ -0,0 +1,350 @@
+/*
+ * metrics.c - counters and latency histograms, served as text.
+ *
+ * Every thread counts into its own block, so the request path never
+ * takes a lock or bounces a shared cache line to count something: a
+ * block has a single writer, which stores with relaxed atomics, and
+ * readers add up all blocks. Blocks are found through a thread-specific
+ * key; when a thread exits, its counts are folded into the retired
+ * totals and the block waits for the next thread.
+ *
+ * GET /__proxy/stats, sent to the proxy itself rather than through it,
+ * returns the totals in the Prometheus text format.
+ */
+#include "metrics.h"
+#include "cache.h"
+#include <stdarg.h>
+#include <time.h>
+
+static pthread_key_t block_key;
+static metrics_block *live;         /* Blocks of running threads */
+static metrics_block *spare;        /* Blocks of exited threads */
+static metrics_block retired;       /* What exited threads counted */
+static long gauges[METRIC_GAUGES];  /* Go up and down, so shared */
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static const char *kind_names[LATENCY_KINDS] = { "hit", "miss", "connect" };
+
+/* fold: add the counts of b to the retired totals, metrics_lock held */
+static void fold(metrics_block *b)
+{
+    int i, k, j;
+
+    for (i = 0; i < METRIC_COUNTERS; i++)
+    {
+        retired.counter[i] += b->counter[i];
+    }
+    for (k = 0; k < LATENCY_KINDS; k++)
+    {
+        for (j = 0; j < METRICS_BUCKETS; j++)
+        {
+            retired.hist[k].count[j] += b->hist[k].count[j];
+        }
+        retired.hist[k].total += b->hist[k].total;
+        retired.hist[k].sum_us += b->hist[k].sum_us;
+    }
+}
+
+/* block_exit: key destructor, the thread owning b is exiting */
+static void block_exit(void *vargp)
+{
+    metrics_block *b = vargp, **pp;
+
+    pthread_mutex_lock(&metrics_lock);
+    fold(b);
+    for (pp = &live; *pp != b; pp = &(*pp)->next)
+    {
+        ;
+    }
+    *pp = b->next;
+    b->next = spare;
+    spare = b;
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* my_block: the calling thread's block, registered on first use */
+static metrics_block *my_block()
+{
+    metrics_block *b = pthread_getspecific(block_key);
+
+    if (b != NULL)
+    {
+        return b;
+    }
+    pthread_mutex_lock(&metrics_lock);
+    if ((b = spare) != NULL)
+    {
+        spare = b->next;
+        memset(b, 0, sizeof(metrics_block));
+    }
+    else
+    {
+        b = Calloc(1, sizeof(metrics_block));
+    }
+    b->next = live;
+    live = b;
+    pthread_mutex_unlock(&metrics_lock);
+    pthread_setspecific(block_key, b);
+    return b;
+}
+
+/* bump: add n to a counter only this thread writes */
+static void bump(long *cnt, long n)
+{
+    __atomic_store_n(cnt, *cnt + n, __ATOMIC_RELAXED);
+}
+
+/* bucket_of: histogram bucket for us microseconds */
+static int bucket_of(unsigned long us)
+{
+    int e, b;
+
+    if (us < (1 << METRICS_SUB_BITS))
+    {
+        return us;
+    }
+    e = 63 - __builtin_clzl(us);
+    b = ((e - METRICS_SUB_BITS + 1) << METRICS_SUB_BITS)
+        | ((us >> (e - METRICS_SUB_BITS)) & ((1 << METRICS_SUB_BITS) - 1));
+    return b < METRICS_BUCKETS ? b : METRICS_BUCKETS - 1;
+}
+
+/* bucket_top: the first value above bucket b, in microseconds */
+static double bucket_top(int b)
+{
+    int g = b >> METRICS_SUB_BITS, s = b & ((1 << METRICS_SUB_BITS) - 1);
+
+    if (g == 0)
+    {
+        return s + 1;
+    }
+    return (double)(((1UL << METRICS_SUB_BITS) + s + 1) << (g - 1));
+}
+
+/* metrics_init: prepare the thread-specific blocks */
+void metrics_init()
+{
+    pthread_key_create(&block_key, block_exit);
+}
+
+/* metrics_count: add n to one of the METRIC_ counters */
+void metrics_count(int counter, long n)
+{
+    bump(&my_block()->counter[counter], n);
+}
+
+/* metrics_gauge: move one of the GAUGE_ gauges by delta */
+void metrics_gauge(int gauge, long delta)
+{
+    __atomic_add_fetch(&gauges[gauge], delta, __ATOMIC_RELAXED);
+}
+
+/* metrics_now: a monotonic clock in microseconds, for latencies */
+long metrics_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/* metrics_latency: record the time since start_us in a histogram */
+void metrics_latency(int kind, long start_us)
+{
+    metrics_hist *h = &my_block()->hist[kind];
+    long us = metrics_now() - start_us;
+
+    if (us < 0)
+    {
+        us = 0;
+    }
+    bump(&h->count[bucket_of(us)], 1);
+    bump(&h->total, 1);
+    bump(&h->sum_us, us);
+}
+
+/* emit: append formatted text to buf, which holds *len of max bytes */
+static void emit(char *buf, size_t *len, size_t max, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf + *len, max - *len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+    {
+        *len = (*len + n < max) ? *len + n : max - 1;
+    }
+}
+
+/* sum_blocks: add up every block into total */
+static void sum_blocks(metrics_block *total)
+{
+    metrics_block *b;
+    int i, k, j;
+
+    pthread_mutex_lock(&metrics_lock);
+    *total = retired;
+    for (b = live; b != NULL; b = b->next)
+    {
+        for (i = 0; i < METRIC_COUNTERS; i++)
+        {
+            total->counter[i] += __atomic_load_n(&b->counter[i],
+                                                 __ATOMIC_RELAXED);
+        }
+        for (k = 0; k < LATENCY_KINDS; k++)
+        {
+            for (j = 0; j < METRICS_BUCKETS; j++)
+            {
+                total->hist[k].count[j] +=
+                    __atomic_load_n(&b->hist[k].count[j], __ATOMIC_RELAXED);
+            }
+            total->hist[k].total += __atomic_load_n(&b->hist[k].total,
+                                                    __ATOMIC_RELAXED);
+            total->hist[k].sum_us += __atomic_load_n(&b->hist[k].sum_us,
+                                                     __ATOMIC_RELAXED);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+/* quantile: upper bound of the bucket holding quantile q of h, in us */
+static double quantile(metrics_hist *h, double q)
+{
+    long seen = 0, rank = (long)(q * h->total + 0.5);
+    int b;
+
+    for (b = 0; b < METRICS_BUCKETS; b++)
+    {
+        seen += h->count[b];
+        if (seen >= rank && seen > 0)
+        {
+            return bucket_top(b);
+        }
+    }
+    return 0;
+}
+
+/* emit_hist: one latency histogram, one le per power of two */
+static void emit_hist(char *buf, size_t *len, size_t max, int kind,
+                      metrics_hist *h)
+{
+    long cum = 0;
+    int b;
+
+    for (b = 0; b < METRICS_BUCKETS; b++)
+    {
+        cum += h->count[b];
+        /* Last bucket of a power of two */
+        if ((b & ((1 << METRICS_SUB_BITS) - 1))
+            == (1 << METRICS_SUB_BITS) - 1)
+        {
+            emit(buf, len, max, "proxy_latency_seconds_bucket{kind=\"%s\","
+                 "le=\"%g\"} %ld\n", kind_names[kind],
+                 bucket_top(b) / 1e6, cum);
+        }
+    }
+    emit(buf, len, max, "proxy_latency_seconds_bucket{kind=\"%s\","
+         "le=\"+Inf\"} %ld\n", kind_names[kind], h->total);
+    emit(buf, len, max, "proxy_latency_seconds_sum{kind=\"%s\"} %g\n",
+         kind_names[kind], h->sum_us / 1e6);
+    emit(buf, len, max, "proxy_latency_seconds_count{kind=\"%s\"} %ld\n",
+         kind_names[kind], h->total);
+}
+
+/*
+ * metrics_response: a whole HTTP response with the totals, conn_hdr
+ *                   going in its header. The caller frees it.
+ */
+char *metrics_response(const char *conn_hdr, size_t *len)
+{
+    static const double qs[] = { 0.5, 0.9, 0.99, 0.999 };
+    metrics_block total;
+    cache_stats st;
+    char *body = Malloc(METRICS_TEXT_MAX);
+    char *resp;
+    size_t n = 0, hdr;
+    int k, i;
+
+    sum_blocks(&total);
+    cache_get_stats(&st);
+    emit(body, &n, METRICS_TEXT_MAX,
+         "# TYPE proxy_connections_total counter\n"
+         "proxy_connections_total %ld\n"
+         "# TYPE proxy_requests_total counter\n"
+         "proxy_requests_total %ld\n"
+         "# TYPE proxy_cache_hits_total counter\n"
+         "proxy_cache_hits_total{tier=\"memory\"} %ld\n"
+         "proxy_cache_hits_total{tier=\"disk\"} %ld\n"
+         "# TYPE proxy_cache_misses_total counter\n"
+         "proxy_cache_misses_total %ld\n"
+         "# TYPE proxy_coalesced_total counter\n"
+         "proxy_coalesced_total %ld\n"
+         "# TYPE proxy_bytes_served_total counter\n"
+         "proxy_bytes_served_total %ld\n"
+         "# TYPE proxy_origin_timeouts_total counter\n"
+         "proxy_origin_timeouts_total{phase=\"connect\"} %ld\n"
+         "proxy_origin_timeouts_total{phase=\"read\"} %ld\n"
+         "proxy_origin_timeouts_total{phase=\"total\"} %ld\n"
+         "# TYPE proxy_rejected_total counter\n"
+         "proxy_rejected_total %ld\n"
+         "# TYPE proxy_passed_total counter\n"
+         "proxy_passed_total %ld\n"
+         "# TYPE proxy_tunnels_total counter\n"
+         "proxy_tunnels_total %ld\n"
+         "# TYPE proxy_workers gauge\n"
+         "proxy_workers %ld\n"
+         "# TYPE proxy_workers_busy gauge\n"
+         "proxy_workers_busy %ld\n"
+         "# TYPE proxy_accept_queue_depth gauge\n"
+         "proxy_accept_queue_depth %ld\n"
+         "# TYPE proxy_slab_bytes gauge\n"
+         "proxy_slab_bytes %ld\n"
+         "# TYPE proxy_cache_entries gauge\n"
+         "proxy_cache_entries %d\n"
+         "# TYPE proxy_cache_charged_bytes gauge\n"
+         "proxy_cache_charged_bytes %ld\n"
+         "# TYPE proxy_latency_seconds histogram\n",
+         total.counter[METRIC_CONNECTIONS], total.counter[METRIC_REQUESTS],
+         total.counter[METRIC_MEM_HITS], total.counter[METRIC_DISK_HITS],
+         total.counter[METRIC_MISSES], total.counter[METRIC_COALESCED],
+         total.counter[METRIC_BYTES],
+         total.counter[METRIC_TIMEOUTS_CONNECT],
+         total.counter[METRIC_TIMEOUTS_READ],
+         total.counter[METRIC_TIMEOUTS_TOTAL],
+         total.counter[METRIC_REJECTED],
+         total.counter[METRIC_PASSED], total.counter[METRIC_TUNNELS],
+         __atomic_load_n(&gauges[GAUGE_WORKERS], __ATOMIC_RELAXED),
+         __atomic_load_n(&gauges[GAUGE_BUSY], __ATOMIC_RELAXED),
+         __atomic_load_n(&gauges[GAUGE_QUEUED], __ATOMIC_RELAXED),
+         __atomic_load_n(&gauges[GAUGE_SLAB], __ATOMIC_RELAXED),
+         st.entries, st.charged_bytes);
+    for (k = 0; k < LATENCY_KINDS; k++)
+    {
+        emit_hist(body, &n, METRICS_TEXT_MAX, k, &total.hist[k]);
+    }
+    /* Read off the fine buckets, so within an eighth of a power of two */
+    emit(body, &n, METRICS_TEXT_MAX,
+         "# TYPE proxy_latency_quantile_seconds gauge\n");
+    for (k = 0; k < LATENCY_KINDS; k++)
+    {
+        for (i = 0; i < 4; i++)
+        {
+            emit(body, &n, METRICS_TEXT_MAX,
+                 "proxy_latency_quantile_seconds{kind=\"%s\","
+                 "quantile=\"%g\"} %g\n", kind_names[k], qs[i],
+                 quantile(&total.hist[k], qs[i]) / 1e6);
+        }
+    }
+
+    resp = Malloc(MAXLINE + n);
+    hdr = snprintf(resp, MAXLINE, "HTTP/1.1 200 OK\r\n"
+                   "Content-Type: text/plain; version=0.0.4\r\n"
+                   "Content-Length: %zu\r\n"
+                   "Cache-Control: no-store\r\n%s\r\n", n, conn_hdr);
+    memcpy(resp + hdr, body, n);
+    Free(body);
+    *len = hdr + n;
+    return resp;
+}
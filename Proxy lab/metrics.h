@@ -0,0 +1,67 @@
+#ifndef METRICS_H
+#define METRICS_H
+#include "csapp.h"
+
+#define METRICS_PATH     "/__proxy/stats"   /* Asked of the proxy itself */
+#define METRICS_SUB_BITS 3                  /* Buckets per power of two */
+#define METRICS_BUCKETS  256                /* Up to 2^34 microseconds */
+#define METRICS_TEXT_MAX 32768
+
+/* Counters */
+#define METRIC_CONNECTIONS 0
+#define METRIC_REQUESTS    1
+#define METRIC_MEM_HITS    2
+#define METRIC_DISK_HITS   3
+#define METRIC_MISSES      4
+#define METRIC_COALESCED   5   /* Misses served by another's fetch */
+#define METRIC_BYTES       6   /* Response bytes sent to clients */
+#define METRIC_TIMEOUTS_CONNECT 7   /* Server not reached in time */
+#define METRIC_TIMEOUTS_READ    8   /* Server silent for too long */
+#define METRIC_TIMEOUTS_TOTAL   9   /* Response not complete in time */
+#define METRIC_REJECTED   10   /* Connections turned away with a 503 */
+#define METRIC_PASSED     11   /* Requests other than GET, not cached */
+#define METRIC_TUNNELS    12   /* CONNECT tunnels opened */
+#define METRIC_COUNTERS   13
+
+/* Gauges, kept in one place for all threads */
+#define GAUGE_WORKERS  0       /* Threads serving clients */
+#define GAUGE_BUSY     1       /* of which serving a connection */
+#define GAUGE_QUEUED   2       /* Connections waiting for a worker */
+#define GAUGE_SLAB     3       /* Bytes held by slabs, see slab.c */
+#define METRIC_GAUGES  4
+
+/* Latency histograms */
+#define LATENCY_HIT     0      /* Request read to response sent */
+#define LATENCY_MISS    1
+#define LATENCY_CONNECT 2      /* New connection to a server */
+#define LATENCY_KINDS   3
+
+/* Struct for a latency histogram: 2^METRICS_SUB_BITS linear buckets
+ * per power of two of microseconds, as HdrHistogram does */
+typedef struct metrics_hist metrics_hist;
+struct metrics_hist
+{
+    long count[METRICS_BUCKETS];
+    long total;
+    long sum_us;
+};
+
+/* Struct for the counters of one thread. Only that thread writes them,
+ * so it needs no lock; a block is folded into the totals when its
+ * thread exits, and reused by the next one. */
+typedef struct metrics_block metrics_block;
+struct metrics_block
+{
+    long counter[METRIC_COUNTERS];
+    metrics_hist hist[LATENCY_KINDS];
+    metrics_block *next;
+};
+
+void metrics_init();
+void metrics_count(int counter, long n);
+void metrics_gauge(int gauge, long delta);
+long metrics_now();
+void metrics_latency(int kind, long start_us);
+char *metrics_response(const char *conn_hdr, size_t *len);
+
+#endif
@@ -0,0 +1,380 @@
+/*
+ * policy.c - eviction policies for the cache, chosen at startup.
+ *
+ * cache.c owns the hash tables, the accounting and the locks; a policy
+ * only decides where a new line goes, what a hit does and which line
+ * leaves when the budget is exceeded. Each shard runs its own copy.
+ *
+ *   clock    one list, a hit sets a reference bit (second chance)
+ *   lru      one list, a hit moves the line to the end; hits must take
+ *            the shard's write lock for that
+ *   s3fifo   a small FIFO for new lines and a main FIFO for lines hit
+ *            while in the small one, plus ghosts of lines evicted from
+ *            the small queue, which go straight to main if they return
+ *   tinylfu  W-TinyLFU: a small window FIFO in front of a CLOCK main
+ *            list; a line leaving the window only replaces the main
+ *            victim if a count-min sketch saw it more often
+ */
+#include "policy.h"
+
+/* list_push: add line at the end of one of the shard's lists */
+void list_push(cache *s, int list, cache_t *line)
+{
+    cache_list *l = &s->lists[list];
+
+    line->list = list;
+    line->next = NULL;
+    line->prev = l->tail;
+    if (l->tail != NULL)
+    {
+        l->tail->next = line;
+    }
+    else
+    {
+        l->head = line;
+    }
+    l->tail = line;
+    l->charge += line->charge;
+}
+
+/* list_remove: take line off the list it is on */
+void list_remove(cache *s, cache_t *line)
+{
+    cache_list *l = &s->lists[line->list];
+
+    if (line->prev != NULL)
+    {
+        line->prev->next = line->next;
+    }
+    else
+    {
+        l->head = line->next;
+    }
+    if (line->next != NULL)
+    {
+        line->next->prev = line->prev;
+    }
+    else
+    {
+        l->tail = line->prev;
+    }
+    l->charge -= line->charge;
+}
+
+/* list_pop: take the oldest line off a list, NULL if it is empty */
+cache_t *list_pop(cache *s, int list)
+{
+    cache_t *line = s->lists[list].head;
+
+    if (line != NULL)
+    {
+        list_remove(s, line);
+    }
+    return line;
+}
+
+/*
+ * clock_hand: give referenced lines at the head of a list a second
+ *             chance, return the first line without one.
+ */
+static cache_t *clock_hand(cache *s, int list)
+{
+    cache_list *l = &s->lists[list];
+    cache_t *line;
+
+    while ((line = l->head)->ref && line != l->tail)
+    {
+        line->ref = 0;
+        list_remove(s, line);
+        list_push(s, list, line);
+    }
+    return line;
+}
+
+/* set_ref: a hit only writes the reference bit, under the read lock */
+static void set_ref(cache *s, cache_t *line)
+{
+    if (!__atomic_load_n(&line->ref, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&line->ref, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* fifo_insert: new lines go at the end of the first list */
+static void fifo_insert(cache *s, cache_t *line)
+{
+    list_push(s, 0, line);
+}
+
+/*
+ * CLOCK
+ */
+static cache_t *clock_evict(cache *s)
+{
+    cache_t *line = clock_hand(s, 0);
+
+    list_remove(s, line);
+    return line;
+}
+
+static cache_policy clock_policy =
+{
+    "clock", 0, NULL, fifo_insert, set_ref, NULL, clock_evict, NULL
+};
+
+/*
+ * LRU
+ */
+static void lru_hit(cache *s, cache_t *line)
+{
+    list_remove(s, line);
+    list_push(s, 0, line);
+}
+
+static cache_t *lru_evict(cache *s)
+{
+    return list_pop(s, 0);
+}
+
+static cache_policy lru_policy =
+{
+    "lru", 1, NULL, fifo_insert, lru_hit, NULL, lru_evict, NULL
+};
+
+/*
+ * S3-FIFO: list 0 is the small queue, list 1 the main one
+ */
+typedef struct s3fifo_state s3fifo_state;
+struct s3fifo_state
+{
+    unsigned ghosts[S3FIFO_GHOSTS];             /* Ring of hashes */
+    int next;
+    int nghosts;
+    unsigned short slots[S3FIFO_GHOST_SLOTS];   /* Ghosts per hash slot */
+};
+
+/* ghost_slot: the low bits of a hash only pick its shard */
+static unsigned short *ghost_slot(s3fifo_state *st, unsigned hash)
+{
+    return &st->slots[(hash / CACHE_SHARDS) % S3FIFO_GHOST_SLOTS];
+}
+
+static void s3fifo_init(cache *s)
+{
+    s->pstate = Calloc(1, sizeof(s3fifo_state));
+}
+
+/* s3fifo_insert: lines seen again since they left go straight to main */
+static void s3fifo_insert(cache *s, cache_t *line)
+{
+    s3fifo_state *st = s->pstate;
+
+    line->freq = 0;
+    list_push(s, *ghost_slot(st, line->hash) > 0 ? 1 : 0, line);
+}
+
+static void s3fifo_hit(cache *s, cache_t *line)
+{
+    if (__atomic_load_n(&line->freq, __ATOMIC_RELAXED) < S3FIFO_MAX_FREQ)
+    {
+        __atomic_add_fetch(&line->freq, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* s3fifo_ghost: remember the hash of a line evicted from small */
+static void s3fifo_ghost(s3fifo_state *st, unsigned hash)
+{
+    if (st->nghosts == S3FIFO_GHOSTS)
+    {
+        (*ghost_slot(st, st->ghosts[st->next]))--;
+    }
+    else
+    {
+        st->nghosts++;
+    }
+    st->ghosts[st->next] = hash;
+    (*ghost_slot(st, hash))++;
+    st->next = (st->next + 1) % S3FIFO_GHOSTS;
+}
+
+static cache_t *s3fifo_evict(cache *s)
+{
+    cache_t *line;
+
+    while (1)
+    {
+        /* Small queue over its share, or nothing else to take from */
+        if (s->lists[0].head != NULL
+            && ((long)s->lists[0].charge * 100
+                > (long)s->charge * S3FIFO_SMALL_PCT
+                || s->lists[1].head == NULL))
+        {
+            line = list_pop(s, 0);
+            if (line->freq > 0)
+            {
+                line->freq = 0;
+                list_push(s, 1, line);
+                continue;
+            }
+            s3fifo_ghost(s->pstate, line->hash);
+            return line;
+        }
+        line = list_pop(s, 1);
+        if (line->freq > 0)
+        {
+            line->freq--;
+            list_push(s, 1, line);
+            continue;
+        }
+        return line;
+    }
+}
+
+static void free_state(cache *s)
+{
+    Free(s->pstate);
+}
+
+static cache_policy s3fifo_policy =
+{
+    "s3fifo", 0, s3fifo_init, s3fifo_insert, s3fifo_hit, NULL,
+    s3fifo_evict, free_state
+};
+
+/*
+ * W-TinyLFU: list 0 is the window, list 1 the main CLOCK list
+ */
+typedef struct tinylfu_state tinylfu_state;
+struct tinylfu_state
+{
+    unsigned char count[TINYLFU_DEPTH][TINYLFU_WIDTH];
+    int samples;      /* Counts are halved every 10 * width samples */
+};
+
+/* sketch_index: counter for hash in one row of the sketch */
+static unsigned sketch_index(unsigned hash, int row)
+{
+    static const unsigned seeds[TINYLFU_DEPTH] =
+    {
+        0x9e3779b1u, 0x85ebca77u, 0xc2b2ae3du, 0x27d4eb2fu
+    };
+    unsigned h = (hash ^ (hash >> 15)) * seeds[row];
+
+    return (h >> 16) & (TINYLFU_WIDTH - 1);
+}
+
+/*
+ * sketch_add: count one access to hash. Runs under the read lock, so
+ *             counters are updated atomically; a lost update only makes
+ *             an estimate slightly low.
+ */
+static void sketch_add(tinylfu_state *st, unsigned hash)
+{
+    unsigned char *cnt;
+    int i, j;
+
+    for (i = 0; i < TINYLFU_DEPTH; i++)
+    {
+        cnt = &st->count[i][sketch_index(hash, i)];
+        if (__atomic_load_n(cnt, __ATOMIC_RELAXED) < TINYLFU_MAX_COUNT)
+        {
+            __atomic_add_fetch(cnt, 1, __ATOMIC_RELAXED);
+        }
+    }
+    /* Age the counts, so that old popularity fades */
+    if (__atomic_add_fetch(&st->samples, 1, __ATOMIC_RELAXED)
+        == 10 * TINYLFU_WIDTH)
+    {
+        for (i = 0; i < TINYLFU_DEPTH; i++)
+        {
+            for (j = 0; j < TINYLFU_WIDTH; j++)
+            {
+                cnt = &st->count[i][j];
+                __atomic_store_n(cnt, __atomic_load_n(cnt, __ATOMIC_RELAXED)
+                                 / 2, __ATOMIC_RELAXED);
+            }
+        }
+        __atomic_store_n(&st->samples, 0, __ATOMIC_RELAXED);
+    }
+}
+
+/* sketch_estimate: how often hash was seen, at least */
+static int sketch_estimate(tinylfu_state *st, unsigned hash)
+{
+    int i, n, min = TINYLFU_MAX_COUNT;
+
+    for (i = 0; i < TINYLFU_DEPTH; i++)
+    {
+        n = __atomic_load_n(&st->count[i][sketch_index(hash, i)],
+                            __ATOMIC_RELAXED);
+        if (n < min)
+        {
+            min = n;
+        }
+    }
+    return min;
+}
+
+static void tinylfu_init(cache *s)
+{
+    s->pstate = Calloc(1, sizeof(tinylfu_state));
+}
+
+static void tinylfu_hit(cache *s, cache_t *line)
+{
+    sketch_add(s->pstate, line->hash);
+    set_ref(s, line);
+}
+
+static void tinylfu_miss(cache *s, unsigned hash)
+{
+    sketch_add(s->pstate, hash);
+}
+
+static cache_t *tinylfu_evict(cache *s)
+{
+    cache_t *cand, *victim;
+
+    while (1)
+    {
+        /* Window within its share: evict from main as CLOCK would */
+        if (s->lists[0].head == NULL
+            || ((long)s->lists[0].charge * 100
+                <= (long)s->charge * TINYLFU_WINDOW_PCT
+                && s->lists[1].head != NULL))
+        {
+            victim = clock_hand(s, 1);
+            list_remove(s, victim);
+            return victim;
+        }
+
+        /* The oldest window line wants into main */
+        cand = list_pop(s, 0);
+        if (s->lists[1].head == NULL)
+        {
+            list_push(s, 1, cand);
+            continue;
+        }
+        victim = clock_hand(s, 1);
+        if (sketch_estimate(s->pstate, cand->hash)
+            > sketch_estimate(s->pstate, victim->hash))
+        {
+            list_remove(s, victim);
+            list_push(s, 1, cand);
+            return victim;
+        }
+        return cand;
+    }
+}
+
+static cache_policy tinylfu_policy =
+{
+    "tinylfu", 0, tinylfu_init, fifo_insert, tinylfu_hit, tinylfu_miss,
+    tinylfu_evict, free_state
+};
+
+/* The first one is the default */
+cache_policy *cache_policies[] =
+{
+    &clock_policy, &lru_policy, &s3fifo_policy, &tinylfu_policy, NULL
+};
@@ -0,0 +1,43 @@
+#ifndef POLICY_H
+#define POLICY_H
+#include "cache.h"
+
+/* S3-FIFO */
+#define S3FIFO_SMALL_PCT   10   /* Share of a shard for the small queue */
+#define S3FIFO_GHOSTS     256   /* Evicted hashes remembered per shard */
+#define S3FIFO_GHOST_SLOTS 1024
+#define S3FIFO_MAX_FREQ     3
+
+/* W-TinyLFU */
+#define TINYLFU_WINDOW_PCT  1   /* Share of a shard for the window */
+#define TINYLFU_DEPTH       4   /* Count-min sketch rows */
+#define TINYLFU_WIDTH    1024   /* Counters per row, a power of two */
+#define TINYLFU_MAX_COUNT  15
+
+/*
+ * Struct for an eviction policy. Every hook runs with the shard write
+ * locked, except hit and miss: those run under the read lock unless
+ * hit_wlock is set, so they may only change lines atomically.
+ */
+typedef struct cache_policy cache_policy;
+struct cache_policy
+{
+    const char *name;
+    int hit_wlock;                                /* hit relinks lines */
+    void (*init)(cache *s);
+    void (*insert)(cache *s, cache_t *line);      /* line is new */
+    void (*hit)(cache *s, cache_t *line);
+    void (*miss)(cache *s, unsigned hash);
+    cache_t *(*evict)(cache *s);                  /* unlink a victim */
+    void (*free)(cache *s);
+};
+
+/* Policies to choose from at startup */
+extern cache_policy *cache_policies[];
+
+/* List helpers for the policies */
+void list_push(cache *s, int list, cache_t *line);
+void list_remove(cache *s, cache_t *line);
+cache_t *list_pop(cache *s, int list);
+
+#endif
@@ -8,220 +8,1433 @@
  *  ************************************************************************  *
  *                               DOCUMENTATION                                *
  *                                                                            *
- * Based on the example of tiny and echo， I construct the basic structure of *
+ * Based on the example of tiny and echo， I construct the basic structure of  *
  * proxy. It listens to coming connections. After established a connection,   *
  * my proxy reads the request from cliend and parse the uri. Then it delivers *
  * the request to server the response to client.                              *
  * By creating multiple threads, the proxy can deal with cocurrent requests.  *
- * I use a double linked list to construct the cache, new cache line will be  *
- * add to end of the list; thus the start of the list is the cache line to be *
- * evicted. After read one cache, I move it to the end of the list.           *
+ * Accepted connections wait in a bounded queue for a fixed pool of worker    *
+ * threads (see sbuf.c); when the queue is full, they get a 503 at once.      *
+ * With -l <n>, n sockets listen on the port with SO_REUSEPORT, and the       *
+ * kernel spreads new connections across their accept threads.                *
+ * The cache is split into lock-striped shards. Each shard is a hash table on *
+ * the uri plus a double linked list, new cache line will be add to end of    *
+ * the list; thus the start of the list is the cache line to be evicted.      *
+ * A hit only sets the line's reference bit, so readers never relink the      *
+ * list; eviction gives referenced lines a second chance (CLOCK).             *
+ * Other eviction policies can be picked with -p (see policy.c).              *
+ * Lines are keyed on the uri with the host in lower case and no :80, so      *
+ * spellings of one uri share a line; -s sorts query parameters too.          *
+ * With -d <dir>, evicted lines go to segment files on disk and are sent      *
+ * from there with sendfile on later hits (see disk.c).                       *
+ * Cache lines are reference counted: a hit pins the line and writes it       *
+ * after the lock is dropped, an evicted line is freed by its last reader.    *
+ * Requests go to servers as HTTP/1.1 over pooled keep-alive connections      *
+ * (see upstream.c); http.c tracks where each response ends. Server names     *
+ * are resolved by a shared cache with its own resolver threads (dns.c).      *
+ * Clients missing on a uri that is already being fetched share that fetch    *
+ * and get its bytes as they arrive (see inflight.c).                         *
+ * Responses are cached as Cache-Control and Expires allow; once stale, a     *
+ * line is revalidated with its ETag or Last-Modified, and a 304 makes it     *
+ * fresh again without the body being sent twice. With -g, stale lines        *
+ * are still served for a while and fetched again in the background           *
+ * meanwhile (see refresh.c).                                                 *
+ * A server gets CONNECT_TIMEOUT_MS to accept the connection and              *
+ * READ_TIMEOUT_MS between two reads, and the whole response must be in       *
+ * within TOTAL_TIMEOUT_MS (-t changes them). Past that, the client gets a    *
+ * 504 if none of the response was sent yet.                                  *
+ * GET /__proxy/stats, asked of the proxy itself, returns counters and        *
+ * latency histograms in the Prometheus text format (see metrics.c).          *
+ * Requests are parsed in place (http.c keeps offsets into the read buffer,   *
+ * not copies), and the client's own header fields go on to the server with   *
+ * the request line and Host in a single writev.                              *
+ * Only GET responses are cached. Other methods go to the server every time,  *
+ * their bodies streamed through, and a CONNECT becomes a tunnel whose bytes  *
+ * are moved with splice (see tunnel.c).                                      *
+ * A connection's buffers and the chunks of a response being relayed come     *
+ * from per-thread slabs instead of the stack and malloc (see slab.c).        *
+ * With -c <file>, the cache is saved to a snapshot file on SIGUSR1 and       *
+ * before the proxy ends on SIGTERM or SIGINT, and filled from it again at    *
+ * startup (see snapshot.c).                                                  *
  * I write my own wrapper functions to hand read/write error.                 *
+ * With -e <n>, the proxy instead runs n epoll event-loop threads that serve  *
+ * every connection with non-blocking sockets (see event.c).                  *
  ******************************************************************************
  */
 #include <stdio.h>
 #include "csapp.h"
+#include "proxy.h"
 #include "cache.h"
-#include "cache.c"
+#include "http.h"
+#include "upstream.h"
+#include "dns.h"
+#include "inflight.h"
+#include "disk.h"
+#include "refresh.h"
+#include "metrics.h"
+#include "sbuf.h"
+#include "affinity.h"
+#include "tunnel.h"
+#include "slab.h"
+#include "snapshot.h"
+#include <poll.h>
+#include <netinet/tcp.h>
+#include <sys/sendfile.h>
 
-/* Recommended max cache and object sizes */
-#define MAX_CACHE_SIZE 1049000
-#define MAX_OBJECT_SIZE 102400
+/* Limits on one client connection */
+#define CLIENT_MAX_REQUESTS 100   /* Requests served before closing */
+#define CLIENT_IDLE_SECS     15   /* Wait this long for the next request */
+#define CLIENT_YIELD_MS     100   /* and look this often whether others
+                                     are waiting for the worker */
+
+/* Threads serving clients, and accepted connections waiting for them */
+#define CLIENT_WORKERS      128   /* Changed with -w */
+#define CLIENT_QUEUE_MAX    256
 
 /* You won't lose style points for including this long line in your code */
 static const char *user_agent_hdr = "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n";
 static const char *conn_close = "Connection: close\r\n";
 static const char *proxy_conn_close = "Proxy-Connection: close\r\n";
+static const char *conn_keep_alive = "Connection: keep-alive\r\n";
+const char *gateway_timeout = "HTTP/1.1 504 Gateway Timeout\r\n"
+                              "Content-Type: text/plain\r\n"
+                              "Content-Length: 35\r\n"
+                              "Connection: close\r\n\r\n"
+                              "The server did not answer in time.\n";
+const char *bad_request = "HTTP/1.1 400 Bad Request\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: 31\r\n"
+                          "Connection: close\r\n\r\n"
+                          "The request body is ambiguous.\n";
+static const char *go_on = "HTTP/1.1 100 Continue\r\n\r\n";
+static const char *established = "HTTP/1.1 200 Connection Established"
+                                 "\r\n\r\n";
+static const char *busy = "HTTP/1.1 503 Service Unavailable\r\n"
+                          "Retry-After: 1\r\n"
+                          "Content-Type: text/plain\r\n"
+                          "Content-Length: 23\r\n"
+                          "Connection: close\r\n\r\n"
+                          "The proxy is too busy.\n";
 
-/* Global Variable for lock */
-sem_t mutex;
-sem_t w;
-int readcnt;
+int connect_timeout_ms = CONNECT_TIMEOUT_MS;
+int read_timeout_ms = READ_TIMEOUT_MS;
+int total_timeout_ms = TOTAL_TIMEOUT_MS;
+int uri_sort_query;
 
 /* Helper functions */
-void parse_uri(char *uri, char *hostname, char *path, char *port);
-void serve(int fd, char* uri, char *hostname, 
-    char *path, char *port);
-void *doit(void *ptr);
+int serve(int fd, char* uri, char *hostname, char *path, char *port,
+          int keep_alive, inflight_t *f, cache_t *stale, http_req *req,
+          const char *reqbuf, rio_t *client);
+void tunnel(int fd, rio_t *rp, char *hostname, char *port);
+int follow(int fd, inflight_reader *r, int keep_alive);
+void doit(int fd);
+void *worker(void *vargp);
+void reject(int fd);
+void turn_away(int fd, const char *resp);
 void Rio_writen_revise(int fd, void *usrbuf, size_t n);
+void Rio_writev_revise(int fd, struct iovec *iov, int iovcnt);
 ssize_t Rio_readlineb_revise(rio_t *rp, void *usrbuf, size_t maxlen);
+ssize_t Rio_readchunkb_revise(rio_t *rp, void *usrbuf, size_t n);
+void Sendfile_revise(int fd, int in_fd, off_t off, size_t n);
+void send_disk(int fd, disk_hit *hit, const char *conn_hdr);
+void *report(void *vargp);
+void refetch(cache_t *line);
+void *acceptor(void *vargp);
+int Open_listenfd_revise(char *port, int reuseport);
 
-int main(int argc, char **argv)
+/* Signals handled by the report thread */
+static sigset_t report_mask;
+
+/* Accepted connections waiting for a worker */
+static sbuf_t clients;
+
+/* Struct for what doit keeps of the client connection it serves */
+typedef struct client_ctx client_ctx;
+struct client_ctx
 {
-    int listenfd;
-    int *connfd_ptr;
-    char hostname[MAXLINE], port[MAXLINE];
-    socklen_t clientlen;
-    struct sockaddr_storage clientaddr;
-    pthread_t  tid;
+    rio_t rio;
+    http_req req;              /* parsed in reqbuf */
+    char reqbuf[MAXLINE];
+    char uri[MAXLINE];         /* as the client sent it */
+    char key[MAXLINE];         /* cache key, see parse_uri */
+    char path[MAXLINE];
+    char hostname[URI_HOST_MAX];
+    char port[URI_PORT_MAX];
+};
+
+/* Client contexts, and chunks of responses being relayed */
+static slab_t client_slab;
+static slab_t chunk_slab;
 
-    Sem_init(&mutex, 0, 1);
-    Sem_init(&w, 0, 1);
+/* Listening sockets, one per accept thread */
+static int *listenfds;
+static int nlisten = 1;
+static int quiet;
 
-    readcnt = 0;
+/* Where the cache is saved and restored from, see -c */
+static char *snapshot_file;
+
+int main(int argc, char **argv)
+{
+    pthread_t  tid;
+    int opt, ev_threads = 0, workers = CLIENT_WORKERS;
+    int c, r, t, i;
+    char *hosts_file = NULL;
+    char *disk_dir = NULL;
 
-    if (argc != 2) 
+    /* -e <n>: serve with n epoll event-loop threads instead of
+     * one thread per connection
+     * -H <file>: resolve the names in this hosts file statically
+     * -p <policy>: evict with clock (default), lru, s3fifo or tinylfu
+     * -d <dir>: keep evicted objects in segment files in this directory
+     * -m <bytes>: cache objects up to this size, those larger than
+     *             MAX_OBJECT_SIZE in the disk tier if there is one
+     * -g <secs>: serve stale lines this long while they are fetched
+     *            again in the background
+     * -q: do not print every accepted connection
+     * -l <n>: listen on n sockets sharing the port (SO_REUSEPORT), each
+     *         with its own accept thread, or its own event loops, kept
+     *         on a core
+     * -w <n>: serve clients with n worker threads, connections beyond
+     *         what they and the queue take get a 503
+     * -t <c>:<r>:<t>: give up on a server after c seconds to connect,
+     *                 r seconds without a byte of the response, or t
+     *                 seconds for the whole response
+     * -s: cache uris whose query parameters differ only in their order
+     *     as one
+     * -c <file>: fill the cache from this snapshot at startup, and save
+     *            it there on SIGUSR1 and on SIGTERM or SIGINT */
+    while ((opt = getopt(argc, argv, "e:H:p:d:m:g:ql:st:w:c:")) != -1)
     {
-        fprintf(stderr, "usage: %s <port>\n", argv[0]);
+        switch (opt)
+        {
+        case 'c':
+            snapshot_file = optarg;
+            break;
+        case 'e':
+            ev_threads = atoi(optarg);
+            break;
+        case 'H':
+            hosts_file = optarg;
+            break;
+        case 'd':
+            disk_dir = optarg;
+            break;
+        case 'm':
+            cache_max_object = strtoul(optarg, NULL, 10);
+            break;
+        case 'g':
+            cache_grace = atoi(optarg);
+            break;
+        case 'q':
+            quiet = 1;
+            break;
+        case 'l':
+            if ((nlisten = atoi(optarg)) <= 0)
+            {
+                ev_threads = -1;
+            }
+            break;
+        case 's':
+            uri_sort_query = 1;
+            break;
+        case 'w':
+            if ((workers = atoi(optarg)) <= 0)
+            {
+                ev_threads = -1;
+            }
+            break;
+        case 't':
+            if (sscanf(optarg, "%d:%d:%d", &c, &r, &t) != 3
+                || c <= 0 || r <= 0 || t <= 0)
+            {
+                ev_threads = -1;
+                break;
+            }
+            connect_timeout_ms = c * 1000;
+            read_timeout_ms = r * 1000;
+            total_timeout_ms = t * 1000;
+            break;
+        case 'p':
+            if (cache_set_policy(optarg) < 0)
+            {
+                ev_threads = -1;
+            }
+            break;
+        default:
+            ev_threads = -1;
+            break;
+        }
+    }
+    if (optind != argc - 1 || ev_threads < 0)
+    {
+        fprintf(stderr, "usage: %s [-e <threads>] [-H <hosts>] [-p <policy>] "
+                "[-d <dir>] [-m <bytes>] [-g <secs>] [-q] [-l <listeners>] "
+                "[-s] [-t <connect>:<read>:<total>] [-w <workers>] "
+                "[-c <snapshot>] <port>\n", argv[0]);
         exit(1);
     }
 
     Signal(SIGPIPE, SIG_IGN);
-    listenfd = Open_listenfd(argv[1]);
+    listenfds = Malloc(nlisten * sizeof(int));
+    for (i = 0; i < nlisten; i++)
+    {
+        listenfds[i] = Open_listenfd_revise(argv[optind], nlisten > 1);
+    }
     cache_init();
+    metrics_init();
+    slab_init(&client_slab, sizeof(client_ctx));
+    slab_init(&chunk_slab, RELAY_BUFSIZE);
+    /* kill -USR1 prints the cache accounting. Blocked here, before any
+     * thread starts, so only the report thread ever takes it. With a
+     * snapshot file, so are the signals that end the proxy, for the
+     * cache to be saved first. */
+    Sigemptyset(&report_mask);
+    Sigaddset(&report_mask, SIGUSR1);
+    if (snapshot_file != NULL)
+    {
+        Sigaddset(&report_mask, SIGTERM);
+        Sigaddset(&report_mask, SIGINT);
+    }
+    Sigprocmask(SIG_BLOCK, &report_mask, NULL);
+    Pthread_create(&tid, NULL, report, NULL);
+    if (disk_dir != NULL)
+    {
+        disk_init(disk_dir);
+    }
+    upstream_init();
+    inflight_init();
+    dns_init(hosts_file);
+    refresh_init(refetch);
 
-    while (1) 
+    /* Warm start: the cache as it was saved, before any client comes */
+    if (snapshot_file != NULL && (i = snapshot_load(snapshot_file)) > 0)
     {
-        clientlen = sizeof(clientaddr);
-        connfd_ptr = Malloc(sizeof(int));
-        *connfd_ptr = Accept(listenfd, (SA *)&clientaddr, &clientlen);
-        Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
-                    port, MAXLINE, 0);
-        printf("Accepted connection from (%s, %s)\n", hostname, port);
-        Pthread_create(&tid, NULL, doit, connfd_ptr);
+        printf("snapshot: %d lines restored from %s\n", i, snapshot_file);
+        fflush(stdout);
     }
+
+    if (ev_threads > 0)
+    {
+        event_run(listenfds, nlisten, ev_threads);
+        cache_free();
+        return 0;
+    }
+
+    /* A fixed pool of workers, so a burst of connections queues up or
+     * is turned away instead of starting a thread each */
+    sbuf_init(&clients, CLIENT_QUEUE_MAX);
+    for (i = 0; i < workers; i++)
+    {
+        Pthread_create(&tid, NULL, worker, NULL);
+    }
+    metrics_gauge(GAUGE_WORKERS, workers);
+    /* The main thread is the last accept thread, and pins itself only
+     * once every other thread has started */
+    for (i = 1; i < nlisten; i++)
+    {
+        Pthread_create(&tid, NULL, acceptor, (void *)(long)i);
+    }
+    acceptor((void *)0L);
     cache_free();
     return 0;
 }
 /*
- * doit - handle one HTTP request/response transaction, revise from tiny.c
+ * acceptor - accept connections on listening socket number vargp and
+ *            queue them for the workers, forever.
  */
-void *doit(void *ptr)
+void *acceptor(void *vargp)
 {
-    int fd = *((int*)ptr);
-    char buf[MAXLINE], method[MAXLINE], uri[MAXLINE], version[MAXLINE];
-    char path[MAXLINE], hostname[MAXLINE], port[MAXLINE];
-    rio_t rio;
+    int i = (long)vargp, listenfd = listenfds[i], connfd;
+    char hostname[MAXLINE], port[MAXLINE];
+    socklen_t clientlen;
+    struct sockaddr_storage clientaddr;
+
+    if (nlisten > 1)
+    {
+        affinity_pin(i);
+    }
+    while (1) 
+    {
+        clientlen = sizeof(clientaddr);
+        connfd = Accept(listenfd, (SA *)&clientaddr, &clientlen);
+        metrics_count(METRIC_CONNECTIONS, 1);
+        if (!quiet)
+        {
+            Getnameinfo((SA *) &clientaddr, clientlen, hostname, MAXLINE, 
+                        port, MAXLINE, 0);
+            printf("Accepted connection from (%s, %s)\n", hostname, port);
+        }
+        metrics_gauge(GAUGE_QUEUED, 1);
+        if (!sbuf_try_insert(&clients, connfd))
+        {
+            metrics_gauge(GAUGE_QUEUED, -1);
+            reject(connfd);
+        }
+    }
+    return NULL;
+}
+/*
+ * report - print the cache accounting every time SIGUSR1 comes in, and
+ *          save the cache if there is a snapshot file. SIGTERM and
+ *          SIGINT save it too, then end the proxy.
+ */
+void *report(void *vargp)
+{
+    int sig, n;
 
     Pthread_detach(Pthread_self());
-    Rio_readinitb(&rio, fd);
-    if (!Rio_readlineb_revise(&rio, buf, MAXLINE))
+    while (sigwait(&report_mask, &sig) == 0)
     {
-        return NULL;
+        if (sig == SIGUSR1)
+        {
+            cache_report(stdout);
+            disk_report(stdout);
+            refresh_report(stdout);
+        }
+        if (snapshot_file != NULL
+            && (n = snapshot_save(snapshot_file)) >= 0)
+        {
+            printf("snapshot: %d lines saved to %s\n", n, snapshot_file);
+        }
+        if (sig != SIGUSR1)
+        {
+            exit(0);
+        }
+        fflush(stdout);
     }
+    return NULL;
+}
+/*
+ * worker - serve the connections queued by the accept loop, one after
+ *          the other.
+ */
+void *worker(void *vargp)
+{
+    int fd;
 
-    sscanf(buf, "%s %s %s", method, uri, version);
-    parse_uri(uri, hostname, path, port);
+    Pthread_detach(Pthread_self());
+    while (1)
+    {
+        fd = sbuf_remove(&clients);
+        metrics_gauge(GAUGE_QUEUED, -1);
+        metrics_gauge(GAUGE_BUSY, 1);
+        doit(fd);
+        metrics_gauge(GAUGE_BUSY, -1);
+    }
+    return NULL;
+}
+/*
+ * reject - turn a connection away with a 503, every worker is busy and
+ *          the queue is full. What the client sent so far is read
+ *          first, as closing with unread data would reset the
+ *          connection and could lose the 503 on the way.
+ */
+void reject(int fd)
+{
+    metrics_count(METRIC_REJECTED, 1);
+    turn_away(fd, busy);
+    Close(fd);
+}
+/*
+ * turn_away - send resp, which says the connection closes, then read
+ *             what the client already sent so the close does not reset
+ *             it. The caller closes fd.
+ */
+void turn_away(int fd, const char *resp)
+{
+    char buf[MAXLINE];
 
+    Rio_writen_revise(fd, (void *)resp, strlen(resp));
+    shutdown(fd, SHUT_WR);
+    while (recv(fd, buf, sizeof(buf), MSG_DONTWAIT) > 0)
+    {
+        ;
+    }
+}
+/*
+ * refetch - fetch a stale line again for the refresher, conditionally,
+ *           as a client would but with the response going nowhere. If
+ *           a client is already fetching the uri, leave it to them.
+ */
+void refetch(cache_t *line)
+{
+    static int devnull = -1;
+    char hostname[URI_HOST_MAX], path[MAXLINE], port[URI_PORT_MAX];
+    char key[MAXLINE];
+    inflight_t *f;
+    inflight_reader reader;
 
-    P(&mutex);
-    readcnt++;
-    if (readcnt == 1)
+    if (devnull < 0)
+    {
+        devnull = Open("/dev/null", O_WRONLY, 0);
+    }
+    /* The line's uri is a key already, parsing it gives it back */
+    parse_uri(line->uri, hostname, path, port, key);
+    if (inflight_join(line->uri, line->hash, &f, &reader))
+    {
+        serve(devnull, line->uri, hostname, path, port, 0, f, line, NULL,
+              NULL, NULL);
+    }
+    else
     {
-        P(&w);
+        inflight_leave(&reader);
     }
-    V(&mutex);
+}
+/*
+ * read_request - read the header of the next request into buf, which
+ *                holds max bytes, and parse it into req as it arrives.
+ *                It is copied from the rio buffer a block at a time, and
+ *                what follows it there stays there for the next request.
+ *                Return 1 once it is whole, 0 if the client went away,
+ *                -1 if it is malformed or too large.
+ */
+static int read_request(rio_t *rp, char *buf, size_t max, http_req *req)
+{
+    size_t len = 0, n;
+    int rc;
 
-    cache_t *hit = find_fit(uri);
-    /* Hit in cache */
-    if (hit != NULL)
-    { 
-        Rio_writen_revise(fd, hit->content, hit->size);  
+    http_req_init(req);
+    while (1)
+    {
+        if (rp->rio_cnt <= 0)
+        {
+            while ((rp->rio_cnt = read(rp->rio_fd, rp->rio_buf,
+                                       sizeof(rp->rio_buf))) < 0
+                   && errno == EINTR)
+            {
+                ;
+            }
+            if (rp->rio_cnt <= 0)
+            {
+                rp->rio_cnt = 0;
+                return 0;
+            }
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        if ((n = (size_t)rp->rio_cnt < max - len ? rp->rio_cnt
+                                                  : max - len) == 0)
+        {
+            return -1;
+        }
+        memcpy(buf + len, rp->rio_bufptr, n);
+        rp->rio_bufptr += n;
+        rp->rio_cnt -= n;
+        len += n;
+        if ((rc = http_req_parse(req, buf, len)) != 0)
+        {
+            /* Give back what was copied past the end of the header */
+            if (rc > 0)
+            {
+                rp->rio_bufptr -= len - req->hdr_len;
+                rp->rio_cnt += len - req->hdr_len;
+            }
+            return rc;
+        }
     }
-    
-    P(&mutex);
-    readcnt--;
-    if (readcnt == 0)
+}
+/*
+ * wait_request - wait for the next request on an idle keep-alive
+ *                connection, CLIENT_IDLE_SECS at most, and less when
+ *                other connections are waiting for the worker. Return
+ *                whether one came.
+ */
+static int wait_request(struct pollfd *pfd)
+{
+    int waited, rc;
+
+    for (waited = 0; waited < CLIENT_IDLE_SECS * 1000;
+         waited += CLIENT_YIELD_MS)
     {
-        V(&w);
+        if ((rc = poll(pfd, 1, CLIENT_YIELD_MS)) != 0)
+        {
+            return rc > 0;
+        }
+        if (sbuf_count(&clients) > 0)
+        {
+            return 0;
+        }
     }
-    V(&mutex);
+    return 0;
+}
+/*
+ * doit - handle the HTTP transactions of one client connection, revise
+ *        from tiny.c. With keep-alive, requests are served in order until
+ *        the client closes, goes idle, or hits CLIENT_MAX_REQUESTS.
+ *        Pipelined requests are already waiting in the rio buffer.
+ *        Its buffers are a client_ctx from the worker's slab, not stack.
+ */
+void doit(int fd)
+{
+    client_ctx *c = slab_alloc(&client_slab);
+    unsigned hash;
+    int keep_alive = 1;
+    int nreq, rc;
+    struct pollfd pfd;
+    struct iovec iov[3];
+    inflight_t *f;
+    inflight_reader reader;
+    disk_hit dhit;
+    long start;
+    char *stats;
+    size_t stats_len;
+    int on = 1;
 
-    /* not in cache*/
-    if (hit == NULL)
+    /* A response is several writes and the client waits for all of it,
+     * so Nagle would hold the last one back until the client's delayed
+     * ACK of the one before */
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+    Rio_readinitb(&c->rio, fd);
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    for (nreq = 1; keep_alive && nreq <= CLIENT_MAX_REQUESTS; nreq++)
     {
-        serve(fd, uri, hostname, path, port);
+        /* Wait for the next request unless it is already buffered */
+        if (nreq > 1 && c->rio.rio_cnt <= 0 && !wait_request(&pfd))
+        {
+            break;
+        }
+        if (read_request(&c->rio, c->reqbuf, sizeof(c->reqbuf),
+                         &c->req) <= 0)
+        {
+            break;
+        }
+        memcpy(c->uri, c->reqbuf + c->req.uri.off, c->req.uri.len);
+        c->uri[c->req.uri.len] = '\0';
+        keep_alive = c->req.keep_alive && nreq < CLIENT_MAX_REQUESTS;
+        start = metrics_now();
+        metrics_count(METRIC_REQUESTS, 1);
+
+        /* A body the server could read otherwise than we do, or one
+         * we would leave behind as the next request, is refused */
+        if (!http_req_framing_ok(&c->req))
+        {
+            turn_away(fd, bad_request);
+            break;
+        }
+
+        /* Asked of the proxy itself */
+        if (!strcmp(c->uri, METRICS_PATH))
+        {
+            stats = metrics_response(keep_alive ? conn_keep_alive
+                                                : conn_close, &stats_len);
+            Rio_writen_revise(fd, stats, stats_len);
+            Free(stats);
+            continue;
+        }
+        if (parse_uri(c->uri, c->hostname, c->path, c->port, c->key) < 0)
+        {
+            break;
+        }
+
+        /* A tunnel takes the connection over until either side closes */
+        if (c->req.kind == HTTP_CONNECT)
+        {
+            tunnel(fd, &c->rio, c->hostname, c->port);
+            break;
+        }
+
+        /* Other methods go to the server every time, with their body
+         * streamed through, and their responses are not kept */
+        if (c->req.kind != HTTP_GET)
+        {
+            keep_alive = serve(fd, c->key, c->hostname, c->path, c->port,
+                               keep_alive, NULL, NULL, &c->req, c->reqbuf,
+                               c->req.chunked || c->req.content_length > 0
+                               ? &c->rio : NULL);
+            metrics_count(METRIC_PASSED, 1);
+            metrics_latency(LATENCY_MISS, start);
+            continue;
+        }
+        hash = cache_hash(c->key);
+
+        cache_t *hit = cache_get(c->key, hash);
+        cache_t *stale = NULL;
+        /* A stale line is still sent within the grace window, and
+         * fetched again meanwhile; past it, it is kept pinned to be
+         * revalidated before it is sent */
+        if (hit != NULL && !cache_fresh(&hit->meta))
+        {
+            if (cache_in_grace(&hit->meta))
+            {
+                refresh_start(hit);
+            }
+            else
+            {
+                stale = hit;
+                hit = NULL;
+            }
+        }
+
+        /* Hit in cache: the line is pinned, write it without the lock */
+        if (hit != NULL)
+        { 
+            keep_alive = keep_alive && hit->meta.framed;
+            Rio_writev_revise(fd, iov, cache_iov(hit, keep_alive ?
+                              conn_keep_alive : conn_close, iov));
+            metrics_count(METRIC_MEM_HITS, 1);
+            metrics_count(METRIC_BYTES, hit->size);
+            metrics_latency(LATENCY_HIT, start);
+            cache_put(hit);
+        }
+
+        /* Hit on disk: send it straight from the segment file */
+        else if (stale == NULL && disk_get(c->key, &dhit))
+        {
+            keep_alive = keep_alive && dhit.meta.framed;
+            send_disk(fd, &dhit, keep_alive ? conn_keep_alive : conn_close);
+            metrics_count(METRIC_DISK_HITS, 1);
+            metrics_count(METRIC_BYTES, dhit.size);
+            metrics_latency(LATENCY_HIT, start);
+            disk_put(&dhit);
+        }
+
+        /* not in cache: fetch it, or share a fetch already running */
+        else
+        {
+            /* A response to a request with credentials may be meant
+             * for its client alone: such requests fetch on their own */
+            if (c->req.credentials)
+            {
+                f = inflight_alone(c->key, hash);
+            }
+            else if (!inflight_join(c->key, hash, &f, &reader))
+            {
+                f = NULL;
+                if ((rc = follow(fd, &reader, keep_alive)) < 0)
+                {
+                    f = inflight_alone(c->key, hash);
+                }
+                else
+                {
+                    keep_alive = rc;
+                    metrics_count(METRIC_COALESCED, 1);
+                }
+            }
+            if (f != NULL)
+            {
+                keep_alive = serve(fd, c->key, c->hostname, c->path,
+                                   c->port, keep_alive, f, stale, &c->req,
+                                   c->reqbuf, NULL);
+                metrics_count(METRIC_MISSES, 1);
+            }
+            metrics_latency(LATENCY_MISS, start);
+            if (stale != NULL)
+            {
+                cache_put(stale);
+            }
+        }
     }
-    Free(ptr);
+    slab_free(&client_slab, c);
     Close(fd);
+}
+/* cmp_param: order of two query parameters */
+static int cmp_param(const void *a, const void *b)
+{
+    return strcmp(*(char **)a, *(char **)b);
+}
+/*
+ * sort_query - sort the parameters of the query q in place. A query
+ *              with more than URI_QUERY_MAX of them is left as it is.
+ */
+static void sort_query(char *q)
+{
+    char copy[MAXLINE], *param[URI_QUERY_MAX], *p;
+    int n = 0, i;
+    size_t len = strlen(q);
 
-    return NULL;
+    memcpy(copy, q, len + 1);
+    for (p = copy; ; p++)
+    {
+        if (n == URI_QUERY_MAX)
+        {
+            return;
+        }
+        param[n++] = p;
+        if ((p = strchr(p, '&')) == NULL)
+        {
+            break;
+        }
+        *p = '\0';
+    }
+    qsort(param, n, sizeof(char *), cmp_param);
+    for (i = 0, p = q; i < n; i++)
+    {
+        len = strlen(param[i]);
+        memcpy(p, param[i], len);
+        p += len;
+        *p++ = i + 1 < n ? '&' : '\0';
+    }
 }
 /*
- * parse_uri - parse URI into hostname and path and port number
- *             revise from tiny.c.
+ * parse_uri - parse URI into hostname and path and port number, revise
+ *             from tiny.c. One pass over the uri, each part checked
+ *             against its buffer: URI_HOST_MAX for hostname,
+ *             URI_PORT_MAX for port, MAXLINE for path and key. key is
+ *             the uri the cache knows: the host in lower case, no :80,
+ *             and with -s the query parameters sorted, so spellings of
+ *             one uri share a line. Return 0, or -1 if a part does not
+ *             fit or the port is not a number.
  */
-void parse_uri(char *uri, char *hostname, char *path, char *port)
+int parse_uri(const char *uri, char *hostname, char *path, char *port,
+              char *key)
 {
-    char *hostname_start = strstr(uri, "//");
-    if (hostname_start != NULL)
+    const char *p = strstr(uri, "//");
+    char *q;
+    size_t n;
+    int len;
+
+    p = p != NULL ? p + 2 : uri;
+    for (n = 0; *p != '\0' && *p != '/' && *p != ':' && *p != '?'; p++)
+    {
+        if (n == URI_HOST_MAX - 1)
+        {
+            return -1;
+        }
+        hostname[n++] = tolower((unsigned char)*p);
+    }
+    hostname[n] = '\0';
+
+    n = 0;
+    if (*p == ':')
+    {
+        for (p++; isdigit((unsigned char)*p); p++)
+        {
+            if (n == URI_PORT_MAX - 1)
+            {
+                return -1;
+            }
+            port[n++] = *p;
+        }
+        if (*p != '\0' && *p != '/' && *p != '?')
+        {
+            return -1;
+        }
+    }
+    port[n] = '\0';
+    /* Written back as a plain number, so :080 is :80 */
+    len = n > 0 ? atoi(port) : 80;
+    if (len <= 0 || len > 65535)
+    {
+        return -1;
+    }
+    sprintf(port, "%d", len);
+
+    len = snprintf(path, MAXLINE, "%s%s", *p == '/' ? "" : "/",
+                   *p == '\0' ? "index.html" : p);
+    if (len >= MAXLINE)
+    {
+        return -1;
+    }
+    len = snprintf(key, MAXLINE, "http://%s%s%s%s", hostname,
+                   strcmp(port, "80") ? ":" : "",
+                   strcmp(port, "80") ? port : "", path);
+    if (len >= MAXLINE)
+    {
+        return -1;
+    }
+    if (uri_sort_query && (q = strchr(key, '?')) != NULL)
+    {
+        sort_query(q + 1);
+    }
+    return 0;
+}
+/* add_piece: append len bytes at base to iov, into the last piece if
+ * they follow it in memory */
+static void add_piece(struct iovec *iov, int *n, const void *base,
+                      size_t len)
+{
+    if (*n > 0 && (char *)iov[*n - 1].iov_base + iov[*n - 1].iov_len
+                  == (char *)base)
+    {
+        iov[*n - 1].iov_len += len;
+        return;
+    }
+    iov[*n].iov_base = (void *)base;
+    iov[*n].iov_len = len;
+    (*n)++;
+}
+/*
+ * build_request - the request we send to the server, as pieces of iov
+ *                 for one writev, REQUEST_IOV_MAX at most. The client's
+ *                 method and fields in req, slices of reqbuf, go with it
+ *                 as they are, the fields http_req_forwards keeps; then
+ *                 come our User-Agent, the fields in extra and our
+ *                 Connection field. req is NULL for a GET of our own.
+ *                 A request with a body goes as HTTP/1.1 even when the
+ *                 connection closes after it: HTTP/1.0 has no chunked
+ *                 coding to frame the body with. Nothing is copied, so
+ *                 the pieces stay valid as long as the arguments. Return
+ *                 the number of pieces.
+ */
+int build_request(struct iovec *iov, char *hostname, char *port,
+                  char *path, int keep_alive, const char *extra,
+                  http_req *req, const char *reqbuf)
+{
+    int n = 0, i;
+    int http11 = keep_alive
+                 || (req != NULL && (req->transfer_encoding
+                                     || req->content_length > 0));
+
+    if (req != NULL)
+    {
+        add_piece(iov, &n, reqbuf + req->method.off, req->method.len);
+        add_piece(iov, &n, " ", 1);
+    }
+    else
+    {
+        add_piece(iov, &n, "GET ", 4);
+    }
+    add_piece(iov, &n, path, strlen(path));
+    add_piece(iov, &n, http11 ? " HTTP/1.1\r\nHost: "
+                              : " HTTP/1.0\r\nHost: ", 17);
+    add_piece(iov, &n, hostname, strlen(hostname));
+    if (strcmp(port, "80"))
+    {
+        add_piece(iov, &n, ":", 1);
+        add_piece(iov, &n, port, strlen(port));
+    }
+    add_piece(iov, &n, "\r\n", 2);
+    for (i = 0; req != NULL && i < req->nfields; i++)
+    {
+        if (http_req_forwards(req, reqbuf, i))
+        {
+            add_piece(iov, &n, reqbuf + req->field[i].line.off,
+                      req->field[i].line.len);
+        }
+    }
+    add_piece(iov, &n, user_agent_hdr, strlen(user_agent_hdr));
+    if (*extra)
+    {
+        add_piece(iov, &n, extra, strlen(extra));
+    }
+    if (keep_alive)
     {
-        strcpy(hostname, hostname_start + 2);
+        add_piece(iov, &n, conn_keep_alive, strlen(conn_keep_alive));
     }
     else
     {
-        strcpy(hostname, uri);
+        add_piece(iov, &n, conn_close, strlen(conn_close));
+        add_piece(iov, &n, proxy_conn_close, strlen(proxy_conn_close));
+    }
+    add_piece(iov, &n, "\r\n", 2);
+    return n;
+}
+/*
+ * conditional - write the header fields asking the server whether the
+ *               response described by meta is still current into buf.
+ */
+static void conditional(char *buf, cache_meta *meta)
+{
+    buf[0] = '\0';
+    if (meta->etag[0])
+    {
+        sprintf(buf, "If-None-Match: %s\r\n", meta->etag);
+    }
+    if (meta->last_modified[0])
+    {
+        sprintf(buf + strlen(buf), "If-Modified-Since: %s\r\n",
+                meta->last_modified);
+    }
+}
+/*
+ * read_within - let the next reads from the server connection fd wait
+ *               read_timeout_ms at most, and not past end (monotonic
+ *               ms). Return 0 if end has already passed.
+ */
+static int read_within(int fd, long end)
+{
+    long ms = end - metrics_now() / 1000;
+    struct timeval tv;
+
+    if (ms <= 0)
+    {
+        return 0;
+    }
+    if (ms > read_timeout_ms)
+    {
+        ms = read_timeout_ms;
+    }
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return 1;
+}
+/*
+ * read_server - read a chunk of the response from a server connection,
+ *               within read_within's limits. Return -1 with errno
+ *               EAGAIN if the time runs out.
+ */
+static ssize_t read_server(rio_t *rp, void *usrbuf, long end)
+{
+    if (rp->rio_cnt <= 0 && !read_within(rp->rio_fd, end))
+    {
+        errno = EAGAIN;
+        return -1;
+    }
+    return Rio_readchunkb_revise(rp, usrbuf, RELAY_BUFSIZE);
+}
+/*
+ * timed_out - whether a read from the server that returned rc failed
+ *             for lack of time. A timeout is counted, as of the whole
+ *             response if end has passed.
+ */
+static int timed_out(ssize_t rc, long end)
+{
+    if (rc >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        return 0;
+    }
+    metrics_count(metrics_now() / 1000 >= end ? METRIC_TIMEOUTS_TOTAL
+                                             : METRIC_TIMEOUTS_READ, 1);
+    return 1;
+}
+/*
+ * give_up - the server took too long: answer 504 unless part of the
+ *           response was sent already, and end f without a response.
+ *           Return 0, the client connection cannot stay open.
+ */
+static int give_up(int fd, inflight_t *f, int sent)
+{
+    if (!sent)
+    {
+        Rio_writen_revise(fd, (void *)gateway_timeout,
+                          strlen(gateway_timeout));
+    }
+    inflight_finish(f, 0);
+    return 0;
+}
+/*
+ * use_stale - the server answered 304 to our conditional request, so
+ *             read the rest of its header, make the stale line fresh
+ *             again and send it, to the client and to the followers of
+ *             f. Return whether the client connection can stay open.
+ */
+static int use_stale(int fd, cache_t *stale, rio_t *rio, int serverfd,
+                     char *hostname, char *port, http_resp *resp,
+                     int keep_alive, inflight_t *f, long deadline)
+{
+    char buf[MAXLINE];
+    struct iovec iov[3];
+    int end = 0;
+    ssize_t rc;
+
+    while ((rc = Rio_readlineb_revise(rio, buf, MAXLINE)) > 0)
+    {
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+        {
+            end = 1;
+            break;
+        }
+        http_resp_line(resp, buf, 0);
+    }
+    upstream_release(serverfd, hostname, port,
+                     end && resp->keep_alive && rio->rio_cnt == 0);
+    if (!end)
+    {
+        if (timed_out(rc, deadline))
+        {
+            return give_up(fd, f, 0);
+        }
+        inflight_finish(f, 0);
+        return 0;
     }
 
-    char *path_start = index(hostname, '/');
-    if (path_start == 0)
+    /* A 304 without freshness of its own renews the old lifetime */
+    cache_refresh(stale, http_has_freshness(resp)
+                         ? http_lifetime(resp, time(NULL))
+                         : stale->meta.lifetime);
+    keep_alive = keep_alive && stale->meta.framed;
+    Rio_writev_revise(fd, iov, cache_iov(stale, keep_alive ?
+                      conn_keep_alive : conn_close, iov));
+    metrics_count(METRIC_BYTES, stale->size);
+    inflight_header(f, &stale->meta);
+    inflight_append(f, stale->content, stale->size);
+    inflight_finish(f, 1);
+    return keep_alive;
+}
+/*
+ * keep_chunk - keep a copy of n more bytes in copy while the object
+ *              still fits, and pass them on to the clients following f.
+ */
+static void keep_chunk(inflight_t *f, char *chunk, int n, chain_t *copy,
+                       size_t *sum)
+{
+    inflight_append(f, chunk, n);
+    if (f != NULL && *sum + n <= cache_max_object)
     {
-        strcpy(path, "/index.html");
+        chain_append(copy, chunk, n);
     }
     else
     {
-        strcpy(path, path_start);
-        *path_start = '\0';
-    }    
+        chain_free(copy);
+    }
+    *sum += n;
+}
+/*
+ * send_body - stream the body of the client's request from rp to the
+ *             server on serverfd as it comes, a rio buffer at a time.
+ *             It goes through the rio buffer, so whatever follows the
+ *             body there stays for the next request. A client waiting
+ *             for a 100 gets it first. Return 0 if either side failed.
+ */
+static int send_body(rio_t *rp, int serverfd, http_req *req)
+{
+    http_body body;
+    size_t fed;
+    ssize_t rc;
 
-    char *port_start = index(hostname, ':');
-    if (port_start == 0)
+    if (req->expect_continue)
     {
-        strcpy(port, "80");
-    } else {
-        strcpy(port, port_start + 1);
-        *port_start='\0';
+        Rio_writen_revise(rp->rio_fd, (void *)go_on, strlen(go_on));
+    }
+    http_req_body_init(&body, req);
+    while (!body.done)
+    {
+        if (rp->rio_cnt <= 0)
+        {
+            while ((rc = read(rp->rio_fd, rp->rio_buf, sizeof(rp->rio_buf)))
+                   < 0 && errno == EINTR)
+            {
+                ;
+            }
+            if (rc <= 0)
+            {
+                return 0;
+            }
+            rp->rio_cnt = rc;
+            rp->rio_bufptr = rp->rio_buf;
+        }
+        fed = http_body_feed(&body, rp->rio_bufptr, rp->rio_cnt);
+        if (body.bad
+            || rio_writen(serverfd, rp->rio_bufptr, fed) != (ssize_t)fed)
+        {
+            return 0;
+        }
+        rp->rio_bufptr += fed;
+        rp->rio_cnt -= fed;
     }
-    return;
+    return 1;
+}
+/*
+ * relay_chunk - send n bytes to the client, keep a copy in copy while
+ *               the object still fits.
+ */
+static void relay_chunk(int fd, inflight_t *f, char *chunk, int n,
+                        chain_t *copy, size_t *sum)
+{
+    Rio_writen_revise(fd, chunk, n);
+    keep_chunk(f, chunk, n, copy, sum);
 }
-void serve(int fd, char* uri, char *hostname, 
-    char *path, char *port) {
+/*
+ * serve - forward the request to the server over a pooled keep-alive
+ *         connection and relay the response. The end of the response
+ *         is found from its framing, so the connection can be reused.
+ *         Clients following f get the same bytes, and f ends when
+ *         serve returns. If stale is not NULL, the request is made
+ *         conditional on it. The response is only cached if its
+ *         status and Cache-Control allow. A server that cannot be
+ *         reached, or does not answer, within the timeouts gets the
+ *         client a 504. The client's own fields in req, offsets into
+ *         reqbuf, go to the server with the request; req may be NULL.
+ *         If client is not NULL, the request has a body, streamed from
+ *         there. A request that is not a GET comes with f NULL: its
+ *         response is neither shared nor cached. Return whether the
+ *         client connection can stay open.
+ */
+int serve(int fd, char* uri, char *hostname, char *path, char *port,
+          int keep_alive, inflight_t *f, cache_t *stale, http_req *req,
+          const char *reqbuf, rio_t *client)
+{
 
     int connfd_server_proxy;
+    int reused, reusable;
     rio_t rio;
-    char buf[MAXLINE];
+    char buf[MAXLINE], validators[2 * MAXLINE];
+    http_resp resp;
+    http_body body;
+    cache_meta meta;
+    struct iovec iov[3], req_iov[REQUEST_IOV_MAX];
+
+    chain_t copy;
 
-    char buffer[MAX_OBJECT_SIZE];
+    int read_length;
+    int fed;
+    int first = 1, end = 0, complete;
+    size_t sum = 0;
+    int chunk_length = 0;
+    time_t now;
+    long start, deadline;
 
-    connfd_server_proxy = Open_clientfd(hostname, port);
-    if (connfd_server_proxy < 0)
+    validators[0] = '\0';
+    if (stale != NULL)
     {
-        return;
-    }    
-    Rio_readinitb(&rio, connfd_server_proxy);
-    sprintf(buf, "GET %s HTTP/1.0\r\n", path);
-    sprintf(buf, "%sHost: %s\r\n", buf, hostname);
-    sprintf(buf, "%s%s", buf, user_agent_hdr);
-    sprintf(buf, "%s%s", buf, conn_close);
-    sprintf(buf, "%s%s\r\n", buf, proxy_conn_close);
+        conditional(validators, &stale->meta);
+    }
 
-    Rio_writen_revise(connfd_server_proxy, buf, strlen(buf));
+    /* A pooled connection may have been closed by the server meanwhile,
+     * so retry once on a fresh one if no status line comes back */
+    start = metrics_now();
+    deadline = start / 1000 + total_timeout_ms;
+    while (1)
+    {
+        connfd_server_proxy = upstream_get(hostname, port,
+                                           connect_timeout_ms, &reused);
+        if (connfd_server_proxy < 0)
+        {
+            if (errno == ETIMEDOUT)
+            {
+                metrics_count(METRIC_TIMEOUTS_CONNECT, 1);
+                return give_up(fd, f, 0);
+            }
+            inflight_finish(f, 0);
+            return 0;
+        }
+        if (!reused)
+        {
+            metrics_latency(LATENCY_CONNECT, start);
+        }
+        Rio_readinitb(&rio, connfd_server_proxy);
+        Rio_writev_revise(connfd_server_proxy, req_iov,
+                          build_request(req_iov, hostname, port, path, 1,
+                                        validators, req, reqbuf));
+        if (client != NULL
+            && !send_body(client, connfd_server_proxy, req))
+        {
+            upstream_release(connfd_server_proxy, hostname, port, 0);
+            inflight_finish(f, 0);
+            return 0;
+        }
+        /* The header is read with these limits, the body is read
+         * through read_server which sets them again for each chunk */
+        if (read_within(connfd_server_proxy, deadline))
+        {
+            read_length = Rio_readlineb_revise(&rio, buf, MAXLINE);
+        }
+        else
+        {
+            read_length = -1;
+            errno = EAGAIN;
+        }
+        /* A body cannot be sent twice, it was read from the client */
+        if (read_length > 0 || !reused || client != NULL
+            || (read_length < 0 && errno == EAGAIN))
+        {
+            break;
+        }
+        upstream_release(connfd_server_proxy, hostname, port, 0);
+        start = metrics_now();
+    }
+    http_resp_init(&resp);
+    if (read_length <= 0 || http_resp_line(&resp, buf, 1) < 0)
+    {
+        upstream_release(connfd_server_proxy, hostname, port, 0);
+        if (timed_out(read_length, deadline))
+        {
+            return give_up(fd, f, 0);
+        }
+        inflight_finish(f, 0);
+        return 0;
+    }
+    if (stale != NULL && resp.status == 304)
+    {
+        return use_stale(fd, stale, &rio, connfd_server_proxy, hostname,
+                         port, &resp, keep_alive, f, deadline);
+    }
 
-    int read_length;
-    int sum = 0;
-    while ((read_length = Rio_readlineb_revise(&rio, buf, MAXLINE)) != 0)
+    char *chunk = slab_alloc(&chunk_slab);
+    chain_init(&copy);
+
+    /* Header block: read it line by line, but send it in one write.
+     * Connection fields only describe our link to the server. */
+    do
+    {
+        if (!strcmp(buf, "\r\n") || !strcmp(buf, "\n"))
+        {
+            end = 1;
+            break;
+        }
+        if (!first)
+        {
+            http_resp_line(&resp, buf, 0);
+            if (http_is_hop_header(buf))
+            {
+                continue;
+            }
+        }
+        first = 0;
+        if (chunk_length + read_length > RELAY_BUFSIZE)
+        {
+            relay_chunk(fd, f, chunk, chunk_length, &copy, &sum);
+            chunk_length = 0;
+        }
+        memcpy(chunk + chunk_length, buf, read_length);
+        chunk_length += read_length;
+    } while ((read_length = Rio_readlineb_revise(&rio, buf, MAXLINE)) > 0);
+    if (!end)
     {
-        Rio_writen_revise(fd, buf, read_length);
-        if ((sum + read_length) < MAX_OBJECT_SIZE)
+        slab_free(&chunk_slab, chunk);
+        chain_free(&copy);
+        upstream_release(connfd_server_proxy, hostname, port, 0);
+        if (timed_out(read_length, deadline))
         {
-            memcpy(buffer + sum, buf, read_length);
+            return give_up(fd, f, sum > 0);
         }
-        sum += read_length;
+        inflight_finish(f, 0);
+        return 0;
     }
-    if (sum < MAX_OBJECT_SIZE)
+
+    /* The client can only stay if it can find the end of the body.
+     * Our Connection field goes to this client only, the cached copy
+     * gets one per hit (see cache_iov). */
+    http_body_init(&body, &resp);
+    if (req != NULL && req->kind == HTTP_HEAD)
     {
-        P(&w);
-        while(sum + c->size > MAX_CACHE_SIZE)
+        body.mode = BODY_NONE;
+        body.done = 1;
+    }
+    keep_alive = keep_alive && body.mode != BODY_EOF;
+    /* Zeroed first: meta is written whole to the disk tier and snapshots */
+    memset(&meta, 0, sizeof(meta));
+    meta.hdr_len = sum + chunk_length;
+    meta.framed = (body.mode != BODY_EOF);
+    now = time(NULL);
+    meta.lifetime = http_lifetime(&resp, now);
+    meta.expires = now + meta.lifetime;
+    meta.revalidate = resp.no_cache || resp.must_revalidate;
+    strcpy(meta.etag, resp.etag);
+    strcpy(meta.last_modified, resp.last_modified);
+    iov[0].iov_base = chunk;
+    iov[0].iov_len = chunk_length;
+    iov[1].iov_base = (void *)(keep_alive ? conn_keep_alive : conn_close);
+    iov[1].iov_len = strlen(iov[1].iov_base);
+    iov[2].iov_base = "\r\n";
+    iov[2].iov_len = 2;
+    Rio_writev_revise(fd, iov, 3);
+    /* Requests that joined this fetch get it only if any client may */
+    if (!http_shareable(&resp))
+    {
+        inflight_detach(f);
+    }
+    keep_chunk(f, chunk, chunk_length, &copy, &sum);
+    keep_chunk(f, "\r\n", 2, &copy, &sum);
+    inflight_header(f, &meta);
+
+    /* Body: relay it in large chunks, whatever its content, until the
+     * framing says it ended */
+    reusable = resp.keep_alive;
+    read_length = 0;
+    while (!body.done && !body.bad
+           && (read_length = read_server(&rio, chunk, deadline)) > 0)
+    {
+        fed = http_body_feed(&body, chunk, read_length);
+        if (fed < read_length)
         {
-            delete_uri();
+            reusable = 0;
         }
-        add_uri(uri, buffer, sum);
-        V(&w);
-    }    
-    Close(connfd_server_proxy);
-    return;  
+        relay_chunk(fd, f, chunk, fed, &copy, &sum);
+    }
+    slab_free(&chunk_slab, chunk);
+    metrics_count(METRIC_BYTES, sum);
+    /* A body cut short by an error or a timeout is not complete, even
+     * if only the server closing would have ended it */
+    complete = body.done || (body.mode == BODY_EOF && read_length == 0);
+    timed_out(read_length, deadline);
+    if (f != NULL && sum <= cache_max_object && complete
+        && http_storable(&resp, req))
+    {
+        cache_insert(uri, f->hash, &copy, &meta);
+    }
+    else
+    {
+        chain_free(&copy);
+    }
+    /* Only now, so that a request arriving later finds the cache line */
+    inflight_finish(f, complete);
+    reusable = reusable && body.done && rio.rio_cnt == 0;
+    upstream_release(connfd_server_proxy, hostname, port, reusable);
+    return keep_alive && body.done;  
 
 }
+/*
+ * follow - send the response another thread is fetching for the same
+ *          uri, as it arrives. Our Connection field goes in at the end
+ *          of the header, like for a cache hit. Return whether the
+ *          client connection can stay open, or -1 with nothing sent if
+ *          the response is not for sharing, or the fetch failed before
+ *          its header: the caller then fetches on its own.
+ */
+int follow(int fd, inflight_reader *r, int keep_alive)
+{
+    cache_meta meta;
+    struct iovec iov[3];
+    char *chunk;
+    ssize_t n = -1;
+    size_t sent = 0, cut;
+
+    if (inflight_wait_header(r, &meta) != 0)
+    {
+        inflight_leave(r);
+        return -1;
+    }
+    keep_alive = keep_alive && meta.framed;
+    chunk = slab_alloc(&chunk_slab);
+    while ((n = inflight_read(r, chunk, RELAY_BUFSIZE)) > 0)
+    {
+        cut = meta.hdr_len - sent;
+        if (meta.hdr_len >= 0 && (size_t)meta.hdr_len >= sent
+            && cut < (size_t)n)
+        {
+            iov[0].iov_base = chunk;
+            iov[0].iov_len = cut;
+            iov[1].iov_base = (void *)(keep_alive ? conn_keep_alive
+                                                  : conn_close);
+            iov[1].iov_len = strlen(iov[1].iov_base);
+            iov[2].iov_base = chunk + cut;
+            iov[2].iov_len = n - cut;
+            Rio_writev_revise(fd, iov, 3);
+        }
+        else
+        {
+            Rio_writen_revise(fd, chunk, n);
+        }
+        sent += n;
+    }
+    slab_free(&chunk_slab, chunk);
+    metrics_count(METRIC_BYTES, sent);
+    inflight_leave(r);
+    return keep_alive && n == 0;
+}
+/*
+ * tunnel - answer a CONNECT to hostname:port. Once the server is
+ *          connected, tell the client, and pass the bytes both ways
+ *          (see tunnel.c), those the client sent behind its request
+ *          first. A server not reached in time gets the client a 504.
+ */
+void tunnel(int fd, rio_t *rp, char *hostname, char *port)
+{
+    int serverfd = dns_open_clientfd(hostname, port, connect_timeout_ms);
+
+    if (serverfd < 0)
+    {
+        if (errno == ETIMEDOUT)
+        {
+            metrics_count(METRIC_TIMEOUTS_CONNECT, 1);
+            Rio_writen_revise(fd, (void *)gateway_timeout,
+                              strlen(gateway_timeout));
+        }
+        return;
+    }
+    metrics_count(METRIC_TUNNELS, 1);
+    Rio_writen_revise(fd, (void *)established, strlen(established));
+    if (rp->rio_cnt <= 0
+        || rio_writen(serverfd, rp->rio_bufptr, rp->rio_cnt) == rp->rio_cnt)
+    {
+        rp->rio_cnt = 0;
+        tunnel_relay(fd, serverfd, TUNNEL_IDLE_SECS * 1000);
+    }
+    Close(serverfd);
+}
 /*
  * Rio_writen_revise: revise wrapper class from csapp.c, prevent
  *      termination from EPIPE.
@@ -233,17 +1446,174 @@ void Rio_writen_revise(int fd, void *usrbuf, size_t n)
         unix_error("Rio_writen error");
     }
 }
+/*
+ * Rio_writev_revise: write every byte of iov, like Rio_writen_revise
+ *      but for several pieces at once. Terminate only on errors other
+ *      than EPIPE.
+ */
+void Rio_writev_revise(int fd, struct iovec *iov, int iovcnt)
+{
+    ssize_t n;
+
+    while (iovcnt > 0)
+    {
+        if ((n = writev(fd, iov, iovcnt)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno != EPIPE)
+            {
+                unix_error("Rio_writev error");
+            }
+            return;
+        }
+        /* Skip what was written */
+        while (iovcnt > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0)
+        {
+            iov->iov_base = (char *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+/*
+ * Sendfile_revise: send n bytes of in_fd from off to fd without copying
+ *      them through user space. Like Rio_writen_revise, a client gone
+ *      away is not fatal.
+ */
+void Sendfile_revise(int fd, int in_fd, off_t off, size_t n)
+{
+    ssize_t rc;
+
+    while (n > 0)
+    {
+        if ((rc = sendfile(fd, in_fd, &off, n)) <= 0)
+        {
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (rc < 0 && errno != EPIPE && errno != ECONNRESET)
+            {
+                unix_error("Sendfile error");
+            }
+            return;
+        }
+        n -= rc;
+    }
+}
+/*
+ * send_disk - send a disk hit, with conn_hdr put in front of the blank
+ *             line that ends the header as cache_iov does. The socket
+ *             is corked so the pieces leave in full packets.
+ */
+void send_disk(int fd, disk_hit *hit, const char *conn_hdr)
+{
+    int on = 1, off = 0;
+
+    if (hit->meta.hdr_len < 0)
+    {
+        Sendfile_revise(fd, hit->fd, hit->off, hit->size);
+        return;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+    Sendfile_revise(fd, hit->fd, hit->off, hit->meta.hdr_len);
+    Rio_writen_revise(fd, (void *)conn_hdr, strlen(conn_hdr));
+    Sendfile_revise(fd, hit->fd, hit->off + hit->meta.hdr_len,
+                    hit->size - hit->meta.hdr_len);
+    setsockopt(fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+}
 /*
  * Rio_readlineb_revise: revise wrapper class from csapp.c, prevent
- *      termination from ECONNRESET.
+ *      termination from ECONNRESET, and from EAGAIN when a server
+ *      connection times out (see read_within).
  */
 ssize_t Rio_readlineb_revise(rio_t *rp, void *usrbuf, size_t maxlen)
 {
     ssize_t rc;
 
-    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0 && errno != ECONNRESET)
+    if ((rc = rio_readlineb(rp, usrbuf, maxlen)) < 0 && errno != ECONNRESET
+        && errno != EAGAIN && errno != EWOULDBLOCK)
     {
         unix_error("Rio_readlineb error");
     }
     return rc;
 }
+/*
+ * Rio_readchunkb_revise: read whatever is available, up to n bytes.
+ *      Bytes left in the rio buffer come first, then the descriptor is
+ *      read directly, so large bodies skip the 8 KB rio buffer.
+ *      Like Rio_readlineb_revise, ECONNRESET and EAGAIN are not fatal.
+ */
+ssize_t Rio_readchunkb_revise(rio_t *rp, void *usrbuf, size_t n)
+{
+    ssize_t rc;
+
+    if (rp->rio_cnt > 0)
+    {
+        rc = rp->rio_cnt < n ? rp->rio_cnt : n;
+        memcpy(usrbuf, rp->rio_bufptr, rc);
+        rp->rio_bufptr += rc;
+        rp->rio_cnt -= rc;
+        return rc;
+    }
+    while ((rc = read(rp->rio_fd, usrbuf, n)) < 0 && errno == EINTR)
+    {
+        ;
+    }
+    if (rc < 0 && errno != ECONNRESET && errno != EAGAIN
+        && errno != EWOULDBLOCK)
+    {
+        unix_error("Rio_readchunkb error");
+    }
+    return rc;
+}
+/*
+ * Open_listenfd_revise: Open_listenfd from csapp.c. With reuseport, the
+ *      socket is opened with SO_REUSEPORT, so several of them can listen
+ *      on the same port and the kernel spreads new connections across
+ *      them by a hash of the client address.
+ */
+int Open_listenfd_revise(char *port, int reuseport)
+{
+    struct addrinfo hints, *listp, *p;
+    int listenfd = -1, optval = 1;
+
+    memset(&hints, 0, sizeof(struct addrinfo));
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE | AI_ADDRCONFIG | AI_NUMERICSERV;
+    Getaddrinfo(NULL, port, &hints, &listp);
+    for (p = listp; p; p = p->ai_next)
+    {
+        if ((listenfd = socket(p->ai_family, p->ai_socktype,
+                               p->ai_protocol)) < 0)
+        {
+            continue;
+        }
+        Setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR,
+                   (const void *)&optval, sizeof(int));
+        if (reuseport)
+        {
+            Setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT,
+                       (const void *)&optval, sizeof(int));
+        }
+        if (bind(listenfd, p->ai_addr, p->ai_addrlen) == 0)
+        {
+            break;
+        }
+        Close(listenfd);
+    }
+    Freeaddrinfo(listp);
+    if (!p || listen(listenfd, LISTENQ) < 0)
+    {
+        unix_error("Open_listenfd error");
+    }
+    return listenfd;
+}
@@ -0,0 +1,48 @@
+#ifndef PROXY_H
+#define PROXY_H
+#include "csapp.h"
+#include "http.h"
+
+/* Recommended max cache and object sizes. MAX_CACHE_SIZE bounds the
+ * memory the cache really takes, overhead of each line included. */
+#define MAX_CACHE_SIZE 1049000
+#define MAX_OBJECT_SIZE 102400
+
+/* Chunk size used to relay response bodies */
+#define RELAY_BUFSIZE 65536
+
+/* Buffers for the parts of a uri, see parse_uri; the path and the
+ * cache key take MAXLINE */
+#define URI_HOST_MAX   256
+#define URI_PORT_MAX     8
+#define URI_QUERY_MAX   64    /* Parameters sorted with -s, at most */
+
+/* Pieces of a request to a server, at most (see build_request) */
+#define REQUEST_IOV_MAX (HTTP_MAX_FIELDS + 12)
+
+/* A CONNECT tunnel with no byte either way for this long is closed */
+#define TUNNEL_IDLE_SECS 300
+
+/* Default deadlines of a request to a server, changed with -t */
+#define CONNECT_TIMEOUT_MS  5000   /* To get a connection, lookup included */
+#define READ_TIMEOUT_MS    15000   /* Between two reads of the response */
+#define TOTAL_TIMEOUT_MS   60000   /* For the whole response */
+
+extern int connect_timeout_ms;
+extern int read_timeout_ms;
+extern int total_timeout_ms;
+extern const char *gateway_timeout;   /* Our 504 response */
+extern const char *bad_request;       /* Our 400 response */
+extern int uri_sort_query;            /* Sort query parameters in keys */
+
+/* Helper functions shared by the threaded and event-loop modes */
+int parse_uri(const char *uri, char *hostname, char *path, char *port,
+              char *key);
+int build_request(struct iovec *iov, char *hostname, char *port,
+                  char *path, int keep_alive, const char *extra,
+                  http_req *req, const char *reqbuf);
+
+/* Event-loop mode (event.c) */
+void event_run(int *listenfds, int nlisten, int nthreads);
+
+#endif
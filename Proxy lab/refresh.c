@@ -0,0 +1,110 @@
+/*
+ * refresh.c - fetch lines again in the background as they go stale.
+ *
+ * Within the grace window after a line expires (-g), clients are still
+ * served the stale copy, and the first of them hands the line to the
+ * refresher thread here. It fetches the uri once, conditionally, while
+ * everybody else keeps getting the stale copy; a 304 makes the line
+ * fresh again and a 200 replaces it. So a hot line expiring sends one
+ * request to the server instead of a burst of client misses.
+ */
+#include "refresh.h"
+
+/* How the refresher fetches a line, given at startup */
+static void (*fetch_line)(cache_t *line);
+
+/* Lines waiting for the refresher */
+static refresh_job *queue_head, *queue_tail;
+static int queue_len;
+static long started, dropped;
+
+static pthread_mutex_t refresh_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t refresh_cond = PTHREAD_COND_INITIALIZER;
+
+/* refresher_thread: fetch the queued lines one after the other */
+static void *refresher_thread(void *vargp)
+{
+    refresh_job *job;
+
+    Pthread_detach(Pthread_self());
+    while (1)
+    {
+        pthread_mutex_lock(&refresh_lock);
+        while (queue_head == NULL)
+        {
+            pthread_cond_wait(&refresh_cond, &refresh_lock);
+        }
+        job = queue_head;
+        queue_head = job->next;
+        if (queue_head == NULL)
+        {
+            queue_tail = NULL;
+        }
+        queue_len--;
+        pthread_mutex_unlock(&refresh_lock);
+
+        fetch_line(job->line);
+        cache_unclaim(job->line);
+        Free(job);
+    }
+    return NULL;
+}
+
+/* refresh_init: start the refresher, which fetches lines with fetch */
+void refresh_init(void (*fetch)(cache_t *line))
+{
+    pthread_t tid;
+
+    fetch_line = fetch;
+    Pthread_create(&tid, NULL, refresher_thread, NULL);
+}
+
+/*
+ * refresh_start: have the stale line fetched again, unless it already
+ *                is or too many lines are waiting. Safe to call on
+ *                every hit on the line.
+ */
+void refresh_start(cache_t *line)
+{
+    refresh_job *job;
+
+    if (!cache_claim(line))
+    {
+        return;
+    }
+    job = Malloc(sizeof(refresh_job));
+    job->line = line;
+    job->next = NULL;
+    pthread_mutex_lock(&refresh_lock);
+    if (queue_len >= REFRESH_QUEUE_MAX)
+    {
+        dropped++;
+        pthread_mutex_unlock(&refresh_lock);
+        cache_unclaim(line);
+        Free(job);
+        return;
+    }
+    if (queue_tail == NULL)
+    {
+        queue_head = job;
+    }
+    else
+    {
+        queue_tail->next = job;
+    }
+    queue_tail = job;
+    queue_len++;
+    started++;
+    pthread_cond_signal(&refresh_cond);
+    pthread_mutex_unlock(&refresh_lock);
+}
+
+/* refresh_report: print how many background refreshes there were */
+void refresh_report(FILE *fp)
+{
+    pthread_mutex_lock(&refresh_lock);
+    fprintf(fp, "refresh: %ld started, %ld dropped, %d queued\n",
+            started, dropped, queue_len);
+    pthread_mutex_unlock(&refresh_lock);
+    fflush(fp);
+}
@@ -0,0 +1,19 @@
+#ifndef REFRESH_H
+#define REFRESH_H
+#include "cache.h"
+
+#define REFRESH_QUEUE_MAX 64   /* Lines waiting for the refresher */
+
+/* Struct for a line waiting to be fetched again */
+typedef struct refresh_job refresh_job;
+struct refresh_job
+{
+    cache_t *line;     /* Pinned and claimed until the fetch is done */
+    refresh_job *next;
+};
+
+void refresh_init(void (*fetch)(cache_t *line));
+void refresh_start(cache_t *line);
+void refresh_report(FILE *fp);
+
+#endif
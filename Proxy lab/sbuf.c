@@ -0,0 +1,60 @@
+/*
+ * sbuf.c - bounded producer-consumer buffer of connected descriptors,
+ *          sbuf from CS:APP 12.5.4 with an insert that does not wait.
+ *
+ * The accept loop puts connections in, the worker threads take them
+ * out. When every slot is taken the accept loop must not block, or the
+ * listen backlog grows without anybody noticing: sbuf_try_insert fails
+ * instead and the caller turns the connection away.
+ */
+#include "sbuf.h"
+
+/* sbuf_init: create an empty, bounded, shared FIFO buffer with n slots */
+void sbuf_init(sbuf_t *sp, int n)
+{
+    sp->buf = Calloc(n, sizeof(int));
+    sp->n = n;
+    sp->front = sp->rear = 0;
+    sp->count = 0;
+    Sem_init(&sp->mutex, 0, 1);
+    Sem_init(&sp->slots, 0, n);
+    Sem_init(&sp->items, 0, 0);
+}
+
+/* sbuf_try_insert: insert item at the rear of sp, return 0 if it is full */
+int sbuf_try_insert(sbuf_t *sp, int item)
+{
+    while (sem_trywait(&sp->slots) < 0)
+    {
+        if (errno != EINTR)
+        {
+            return 0;
+        }
+    }
+    P(&sp->mutex);
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    __atomic_store_n(&sp->count, sp->count + 1, __ATOMIC_RELAXED);
+    V(&sp->mutex);
+    V(&sp->items);
+    return 1;
+}
+
+/* sbuf_remove: remove and return the first item of sp, wait for one */
+int sbuf_remove(sbuf_t *sp)
+{
+    int item;
+
+    P(&sp->items);
+    P(&sp->mutex);
+    item = sp->buf[(++sp->front) % (sp->n)];
+    __atomic_store_n(&sp->count, sp->count - 1, __ATOMIC_RELAXED);
+    V(&sp->mutex);
+    V(&sp->slots);
+    return item;
+}
+
+/* sbuf_count: items waiting in sp, without the lock, so only a hint */
+int sbuf_count(sbuf_t *sp)
+{
+    return __atomic_load_n(&sp->count, __ATOMIC_RELAXED);
+}
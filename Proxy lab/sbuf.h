@@ -0,0 +1,24 @@
+#ifndef SBUF_H
+#define SBUF_H
+#include "csapp.h"
+
+/* Struct for a bounded buffer of descriptors, as sbuf in CS:APP 12.5.4 */
+typedef struct sbuf sbuf_t;
+struct sbuf
+{
+    int *buf;          /* Buffer array */
+    int n;             /* Maximum number of slots */
+    int front;         /* buf[(front+1)%n] is first item */
+    int rear;          /* buf[rear%n] is last item */
+    int count;         /* Items in the buffer */
+    sem_t mutex;       /* Protects accesses to buf */
+    sem_t slots;       /* Counts available slots */
+    sem_t items;       /* Counts available items */
+};
+
+void sbuf_init(sbuf_t *sp, int n);
+int sbuf_try_insert(sbuf_t *sp, int item);
+int sbuf_remove(sbuf_t *sp);
+int sbuf_count(sbuf_t *sp);
+
+#endif
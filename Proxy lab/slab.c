@@ -0,0 +1,78 @@
+/*
+ * slab.c - per-thread caches of fixed-size objects.
+ *
+ * Per-connection state and buffers used to live in arrays sized for the
+ * worst case, on the stack or in each connection, so every connection
+ * held tens of KB whether it needed them or not. They now come from
+ * slabs of objects sized for what they hold. Each thread keeps its own
+ * free list per slab, so taking an object and giving it back is a
+ * pointer swap without a lock, and the memory stays warm in the cache
+ * of the core that uses it. An empty list is refilled from one
+ * SLAB_BATCH allocation cut into objects.
+ *
+ * Objects go back to the list of the thread that frees them, which for
+ * the proxy is the one that took them: a worker its request context, an
+ * event loop its connections. Batches are never given back to malloc,
+ * so a thread holds the memory of its peak; the proxy_slab_bytes gauge
+ * counts all of it.
+ */
+#include "slab.h"
+#include "metrics.h"
+
+/* slab_init: set up sp for objects of size bytes, before any thread
+ * takes one */
+void slab_init(slab_t *sp, size_t size)
+{
+    int rc;
+
+    /* A free object holds the link to the next one */
+    if (size < sizeof(void *))
+    {
+        size = sizeof(void *);
+    }
+    sp->size = (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    if ((rc = pthread_key_create(&sp->list, NULL)) != 0)
+    {
+        posix_error(rc, "pthread_key_create error");
+    }
+}
+
+/* refill: cut a new batch into objects, return the list of them */
+static void *refill(slab_t *sp)
+{
+    size_t n = SLAB_BATCH / sp->size, i;
+    char *batch;
+
+    if (n == 0)
+    {
+        n = 1;
+    }
+    batch = Malloc(n * sp->size);
+    for (i = 0; i + 1 < n; i++)
+    {
+        *(void **)(batch + i * sp->size) = batch + (i + 1) * sp->size;
+    }
+    *(void **)(batch + i * sp->size) = NULL;
+    metrics_gauge(GAUGE_SLAB, n * sp->size);
+    return batch;
+}
+
+/* slab_alloc: an object from this thread's list, its contents unset */
+void *slab_alloc(slab_t *sp)
+{
+    void *obj = pthread_getspecific(sp->list);
+
+    if (obj == NULL)
+    {
+        obj = refill(sp);
+    }
+    pthread_setspecific(sp->list, *(void **)obj);
+    return obj;
+}
+
+/* slab_free: give obj back to this thread's list */
+void slab_free(slab_t *sp, void *obj)
+{
+    *(void **)obj = pthread_getspecific(sp->list);
+    pthread_setspecific(sp->list, obj);
+}
@@ -0,0 +1,20 @@
+#ifndef SLAB_H
+#define SLAB_H
+#include "csapp.h"
+
+#define SLAB_BATCH 65536       /* Bytes taken from malloc per refill */
+
+/* Struct for a cache of objects of one size, with a free list of
+ * its own in each thread that uses it */
+typedef struct slab slab_t;
+struct slab
+{
+    size_t size;               /* Bytes per object */
+    pthread_key_t list;        /* This thread's free objects */
+};
+
+void slab_init(slab_t *sp, size_t size);
+void *slab_alloc(slab_t *sp);
+void slab_free(slab_t *sp, void *obj);
+
+#endif
@@ -0,0 +1,242 @@
+/*
+ * snapshot.c - the memory cache saved across restarts.
+ *
+ * snapshot_save writes every line of the cache to one file: a header
+ * with a version and a CRC-32 of what follows, then a record per line,
+ * each shard's lines oldest first. It goes to a temporary file renamed
+ * over the old snapshot once complete, so a crash while saving leaves
+ * the previous one in place. Lines are pinned under the shard's read
+ * lock and written after it is dropped, so requests go on meanwhile.
+ *
+ * snapshot_load maps a snapshot before the proxy accepts connections,
+ * and checks it as a whole before adding any line: a file from another
+ * version, torn, or corrupt is ignored, and the cache starts empty as
+ * it would without one. Lines that are stale and cannot be revalidated
+ * are left out, and so is whatever no longer fits the cache.
+ */
+#include "snapshot.h"
+
+static unsigned crc_table[256];
+
+/* crc_init: table for the CRC-32 of IEEE 802.3, reflected */
+static void crc_init()
+{
+    unsigned c;
+    int n, k;
+
+    for (n = 0; n < 256; n++)
+    {
+        c = n;
+        for (k = 0; k < 8; k++)
+        {
+            c = (c & 1) ? 0xedb88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[n] = c;
+    }
+}
+
+/* crc32: continue a CRC-32 over n more bytes, from crc 0 */
+static unsigned crc32(unsigned crc, const void *buf, size_t n)
+{
+    const unsigned char *p = buf;
+
+    crc = ~crc;
+    while (n-- > 0)
+    {
+        crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+/* put: write n bytes to fp and add them to the CRC, 0 on an error */
+static int put(FILE *fp, const void *buf, size_t n, snap_hdr *hdr)
+{
+    hdr->crc = crc32(hdr->crc, buf, n);
+    hdr->bytes += n;
+    return fwrite(buf, 1, n, fp) == n;
+}
+
+/*
+ * save_shard: write the lines of shard s, oldest first. Return 0, or -1
+ *             on an error.
+ */
+static int save_shard(FILE *fp, cache *s, snap_hdr *hdr)
+{
+    cache_t **lines, *line;
+    cache_meta *metas;
+    snap_rec rec;
+    int n = 0, i, l, ok = 1;
+
+    /* Revalidation updates meta, so it is copied while the lines are
+     * pinned; the content does not change once a line is in */
+    cache_rlock(s);
+    lines = Malloc((s->count + 1) * sizeof(cache_t *));
+    metas = Malloc((s->count + 1) * sizeof(cache_meta));
+    for (l = 0; l < CACHE_LISTS; l++)
+    {
+        for (line = s->lists[l].head; line != NULL; line = line->next)
+        {
+            __sync_fetch_and_add(&line->refcnt, 1);
+            metas[n] = line->meta;
+            metas[n].expires = __atomic_load_n(&line->meta.expires,
+                                               __ATOMIC_RELAXED);
+            lines[n++] = line;
+        }
+    }
+    cache_runlock(s);
+
+    for (i = 0; i < n; i++)
+    {
+        line = lines[i];
+        /* Zeroed first: the padding is written to the file too */
+        memset(&rec, 0, sizeof(rec));
+        rec.uri_len = strlen(line->uri);
+        rec.size = line->size;
+        rec.meta = metas[i];
+        ok = ok && put(fp, &rec, sizeof(rec), hdr)
+             && put(fp, line->uri, rec.uri_len, hdr)
+             && put(fp, line->content, rec.size, hdr);
+        hdr->count++;
+        cache_put(line);
+    }
+    Free(metas);
+    Free(lines);
+    return ok ? 0 : -1;
+}
+
+/*
+ * snapshot_save: write the cache to path. Return the number of lines
+ *                written, or -1 if it could not be, the old snapshot
+ *                then staying as it was.
+ */
+int snapshot_save(char *path)
+{
+    char tmp[MAXLINE];
+    snap_hdr hdr;
+    FILE *fp;
+    int i, ok;
+
+    if (crc_table[1] == 0)
+    {
+        crc_init();
+    }
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    if ((fp = fopen(tmp, "w")) == NULL)
+    {
+        fprintf(stderr, "snapshot: %s: %s\n", tmp, strerror(errno));
+        return -1;
+    }
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = SNAP_MAGIC;
+    hdr.version = SNAP_VERSION;
+    hdr.meta_size = sizeof(cache_meta);
+
+    /* The header goes first as a placeholder, and again once the
+     * records are all written and counted */
+    ok = fwrite(&hdr, sizeof(hdr), 1, fp) == 1;
+    for (i = 0; i < CACHE_SHARDS && ok; i++)
+    {
+        ok = save_shard(fp, &c[i], &hdr) == 0;
+    }
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0
+         && fwrite(&hdr, sizeof(hdr), 1, fp) == 1
+         && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) < 0)
+    {
+        fprintf(stderr, "snapshot: %s: %s\n", tmp, strerror(errno));
+        unlink(tmp);
+        return -1;
+    }
+    return hdr.count;
+}
+
+/* check: true if the len bytes at base are a whole snapshot */
+static int check(char *base, size_t len)
+{
+    snap_hdr hdr;
+
+    if (len < sizeof(hdr))
+    {
+        return 0;
+    }
+    memcpy(&hdr, base, sizeof(hdr));
+    return hdr.magic == SNAP_MAGIC && hdr.version == SNAP_VERSION
+           && hdr.meta_size == sizeof(cache_meta)
+           && hdr.bytes == len - sizeof(hdr)
+           && crc32(0, base + sizeof(hdr), hdr.bytes) == hdr.crc;
+}
+
+/*
+ * snapshot_load: fill the cache from the snapshot at path, if there is
+ *                a valid one. Return the number of lines added, or -1
+ *                if the file was there but not used.
+ */
+int snapshot_load(char *path)
+{
+    char uri[MAXLINE], *base, *p;
+    struct stat st;
+    snap_rec rec;
+    size_t off;
+    int fd, n = 0;
+
+    if (crc_table[1] == 0)
+    {
+        crc_init();
+    }
+    if ((fd = open(path, O_RDONLY)) < 0)
+    {
+        if (errno == ENOENT)
+        {
+            return 0;
+        }
+        fprintf(stderr, "snapshot: %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    Fstat(fd, &st);
+    if (st.st_size == 0)
+    {
+        Close(fd);
+        return -1;
+    }
+    base = Mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    Close(fd);
+    if (!check(base, st.st_size))
+    {
+        fprintf(stderr, "snapshot: %s is not a valid snapshot, "
+                "ignored\n", path);
+        Munmap(base, st.st_size);
+        return -1;
+    }
+
+    /* Checked as a whole, but each record is still bounded */
+    off = sizeof(snap_hdr);
+    while (off + sizeof(rec) <= (size_t)st.st_size)
+    {
+        memcpy(&rec, base + off, sizeof(rec));
+        p = base + off + sizeof(rec);
+        if (rec.uri_len >= MAXLINE
+            || rec.size > (size_t)st.st_size - off - sizeof(rec)
+            || rec.uri_len > (size_t)st.st_size - off - sizeof(rec)
+                             - rec.size)
+        {
+            break;
+        }
+        off += sizeof(rec) + rec.uri_len + rec.size;
+        if (rec.size > cache_max_object
+            || (!cache_fresh(&rec.meta) && !cache_in_grace(&rec.meta)
+                && rec.meta.etag[0] == '\0'
+                && rec.meta.last_modified[0] == '\0'))
+        {
+            continue;
+        }
+        memcpy(uri, p, rec.uri_len);
+        uri[rec.uri_len] = '\0';
+        if (cache_restore(uri, cache_hash(uri), p + rec.uri_len, rec.size,
+                          &rec.meta) == 0)
+        {
+            n++;
+        }
+    }
+    Munmap(base, st.st_size);
+    return n;
+}
@@ -0,0 +1,33 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+#include "cache.h"
+
+#define SNAP_MAGIC   0x50534e50u   /* "PSNP" */
+#define SNAP_VERSION 2             /* Bumped whenever the layout changes */
+
+/* Struct for the header of a snapshot file, followed by its records */
+typedef struct snap_hdr snap_hdr;
+struct snap_hdr
+{
+    unsigned magic;
+    unsigned version;
+    unsigned meta_size;    /* sizeof(cache_meta), saved as it is */
+    unsigned count;        /* Records */
+    unsigned long bytes;   /* Records, in bytes */
+    unsigned crc;          /* CRC-32 of the records */
+};
+
+/* Struct for the header of a record, followed by the uri (without its
+ * NUL) and then the content */
+typedef struct snap_rec snap_rec;
+struct snap_rec
+{
+    unsigned uri_len;
+    unsigned size;
+    cache_meta meta;
+};
+
+int snapshot_save(char *path);
+int snapshot_load(char *path);
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ * tunnel.c - move the bytes of a CONNECT tunnel with splice.
+ *
+ * After a CONNECT, the proxy only copies bytes between the client and
+ * the server, whatever they are. Each way of the tunnel goes through a
+ * pipe of its own: splice moves bytes from one socket into the pipe and
+ * from the pipe into the other socket, so they never come up to user
+ * space. Both sockets are non-blocking, and a way stops reading while
+ * its pipe still holds bytes, so a slow reader holds back its writer
+ * instead of having bytes pile up here. tunnel_relay drives a tunnel
+ * with poll for a worker thread; the event loop drives tunnel_pump from
+ * epoll itself.
+ * This file stays apart from the others because splice needs
+ * _GNU_SOURCE, as affinity.c explains.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "tunnel.h"
+
+/*
+ * tunnel_open: set up d to move bytes from the socket from to the
+ *              socket to, and make from non-blocking. Return -1 if
+ *              there is no pipe to be had.
+ */
+int tunnel_open(tunnel_dir *d, int from, int to)
+{
+    if (pipe(d->pipe) < 0)
+    {
+        return -1;
+    }
+    d->from = from;
+    d->to = to;
+    d->queued = 0;
+    d->eof = 0;
+    fcntl(from, F_SETFL, fcntl(from, F_GETFL) | O_NONBLOCK);
+    return 0;
+}
+
+/*
+ * tunnel_pump: move what d can move without blocking. Once its source
+ *              closed and the pipe is empty, the close is passed on.
+ *              Return -1 on an error.
+ */
+int tunnel_pump(tunnel_dir *d)
+{
+    ssize_t n;
+
+    while (1)
+    {
+        if (d->queued > 0)
+        {
+            n = splice(d->pipe[0], NULL, d->to, NULL, d->queued,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+        else if (d->eof)
+        {
+            return 0;
+        }
+        else
+        {
+            n = splice(d->from, NULL, d->pipe[1], NULL, TUNNEL_CHUNK,
+                       SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (n == 0)
+            {
+                d->eof = 1;
+                shutdown(d->to, SHUT_WR);
+                return 0;
+            }
+        }
+        if (n < 0)
+        {
+            return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+        }
+        d->queued = d->queued > 0 ? d->queued - n : (size_t)n;
+    }
+}
+
+/* tunnel_close: release the pipe of d, the sockets are the caller's */
+void tunnel_close(tunnel_dir *d)
+{
+    close(d->pipe[0]);
+    close(d->pipe[1]);
+}
+
+/*
+ * tunnel_relay: move bytes between the client fd and serverfd until both
+ *               closed, one fails, or idle_ms go by without a byte
+ *               either way. Return -1 if the tunnel could not be set up.
+ */
+int tunnel_relay(int fd, int serverfd, int idle_ms)
+{
+    tunnel_dir dir[2];
+    struct pollfd pfd[2];
+    int i, rc;
+
+    if (tunnel_open(&dir[0], fd, serverfd) < 0)
+    {
+        return -1;
+    }
+    if (tunnel_open(&dir[1], serverfd, fd) < 0)
+    {
+        tunnel_close(&dir[0]);
+        return -1;
+    }
+    pfd[0].fd = fd;
+    pfd[1].fd = serverfd;
+    while (!(dir[0].eof && dir[1].eof))
+    {
+        /* Read a side while its way has nothing queued, write it while
+         * the other way has */
+        for (i = 0; i < 2; i++)
+        {
+            pfd[i].events = (!dir[i].eof && dir[i].queued == 0 ? POLLIN : 0)
+                            | (dir[1 - i].queued > 0 ? POLLOUT : 0);
+        }
+        if ((rc = poll(pfd, 2, idle_ms)) < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0 || ((pfd[0].revents | pfd[1].revents) & POLLERR)
+            || tunnel_pump(&dir[0]) < 0 || tunnel_pump(&dir[1]) < 0)
+        {
+            break;
+        }
+    }
+    tunnel_close(&dir[0]);
+    tunnel_close(&dir[1]);
+    return 0;
+}
@@ -0,0 +1,24 @@
+#ifndef TUNNEL_H
+#define TUNNEL_H
+#include <stddef.h>
+
+#define TUNNEL_CHUNK 65536   /* Bytes moved by one splice */
+
+/* Struct for one way of a tunnel: from one socket into a pipe, and from
+ * the pipe into the other socket */
+typedef struct tunnel_dir tunnel_dir;
+struct tunnel_dir
+{
+    int from;
+    int to;
+    int pipe[2];
+    size_t queued;    /* Bytes in the pipe */
+    int eof;          /* from closed, and to was told */
+};
+
+int tunnel_open(tunnel_dir *d, int from, int to);
+int tunnel_pump(tunnel_dir *d);
+void tunnel_close(tunnel_dir *d);
+int tunnel_relay(int fd, int serverfd, int idle_ms);
+
+#endif
@@ -0,0 +1,221 @@
+/*
+ * upstream.c - pool of persistent connections to origin servers.
+ *
+ * After a response whose end is known (Content-Length or chunked), the
+ * connection to the server is put back in a per-(host, port) pool
+ * instead of being closed, and the next request to the same server
+ * reuses it without DNS, handshake or slow start. Each origin has at
+ * most UPSTREAM_MAX_CONNS connections; callers wait for one to free up
+ * beyond that, within their connect timeout. Idle connections close
+ * after UPSTREAM_IDLE_SECS.
+ */
+#include "upstream.h"
+#include "dns.h"
+
+static origin_t *origins[UPSTREAM_BUCKETS];
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_cond = PTHREAD_COND_INITIALIZER;
+static time_t last_sweep;
+
+/* origin_of: find or create the origin for hostname:port, pool locked */
+static origin_t *origin_of(char *hostname, char *port)
+{
+    char key[MAXLINE];
+    unsigned h = 5381;
+    char *p;
+    origin_t *o;
+
+    snprintf(key, sizeof(key), "%s:%s", hostname, port);
+    for (p = key; *p; p++)
+    {
+        h = h * 33 + (unsigned char)*p;
+    }
+    for (o = origins[h % UPSTREAM_BUCKETS]; o != NULL; o = o->next)
+    {
+        if (!strcmp(o->key, key))
+        {
+            return o;
+        }
+    }
+    o = Calloc(1, sizeof(origin_t));
+    strcpy(o->key, key);
+    o->next = origins[h % UPSTREAM_BUCKETS];
+    origins[h % UPSTREAM_BUCKETS] = o;
+    return o;
+}
+
+/* drop_idle: close the i-th idle connection of o, pool locked */
+static void drop_idle(origin_t *o, int i)
+{
+    Close(o->idle_fd[i]);
+    o->nidle--;
+    o->nconns--;
+    memmove(&o->idle_fd[i], &o->idle_fd[i + 1],
+            (o->nidle - i) * sizeof(int));
+    memmove(&o->idle_since[i], &o->idle_since[i + 1],
+            (o->nidle - i) * sizeof(time_t));
+    pthread_cond_broadcast(&pool_cond);
+}
+
+/* expire: close connections of o idle for too long, pool locked */
+static void expire(origin_t *o, time_t now)
+{
+    while (o->nidle > 0 && now - o->idle_since[0] > UPSTREAM_IDLE_SECS)
+    {
+        drop_idle(o, 0);
+    }
+}
+
+/*
+ * sweep: expire every origin and forget unused ones, pool locked. An
+ *        origin someone waits on is in use even without connections.
+ */
+static void sweep(time_t now)
+{
+    int i;
+    origin_t **pp, *o;
+
+    for (i = 0; i < UPSTREAM_BUCKETS; i++)
+    {
+        pp = &origins[i];
+        while ((o = *pp) != NULL)
+        {
+            expire(o, now);
+            if (o->nconns == 0 && o->nwaiters == 0)
+            {
+                *pp = o->next;
+                Free(o);
+            }
+            else
+            {
+                pp = &o->next;
+            }
+        }
+    }
+    last_sweep = now;
+}
+
+/* is_alive: an idle connection has nothing to read unless it closed */
+static int is_alive(int fd)
+{
+    char ch;
+    ssize_t n = recv(fd, &ch, 1, MSG_PEEK | MSG_DONTWAIT);
+    return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* upstream_init: start with an empty pool */
+void upstream_init()
+{
+    memset(origins, 0, sizeof(origins));
+    last_sweep = time(NULL);
+}
+
+/*
+ * upstream_get: return a connection to hostname:port, an idle one if
+ *               possible. *reused tells whether it came from the pool,
+ *               since the server may still have closed it meanwhile.
+ *               Waiting for a free slot and connecting take timeout_ms
+ *               at most. Return -1 if the server cannot be reached,
+ *               with errno ETIMEDOUT if it took too long.
+ */
+int upstream_get(char *hostname, char *port, int timeout_ms, int *reused)
+{
+    origin_t *o;
+    int fd, err;
+    struct timespec now, until;
+    long left;
+
+    /* pthread_cond_timedwait wants the wall clock */
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_sec += timeout_ms / 1000;
+    until.tv_nsec += (timeout_ms % 1000) * 1000000L;
+    if (until.tv_nsec >= 1000000000L)
+    {
+        until.tv_sec++;
+        until.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&pool_lock);
+    o = origin_of(hostname, port);
+    while (1)
+    {
+        expire(o, time(NULL));
+        /* Most recently used first, it is least likely to be closed */
+        while (o->nidle > 0)
+        {
+            fd = o->idle_fd[--o->nidle];
+            if (is_alive(fd))
+            {
+                pthread_mutex_unlock(&pool_lock);
+                *reused = 1;
+                return fd;
+            }
+            Close(fd);
+            o->nconns--;
+        }
+        if (o->nconns < UPSTREAM_MAX_CONNS)
+        {
+            break;
+        }
+        o->nwaiters++;
+        err = pthread_cond_timedwait(&pool_cond, &pool_lock, &until);
+        o->nwaiters--;
+        if (err == ETIMEDOUT)
+        {
+            pthread_mutex_unlock(&pool_lock);
+            errno = ETIMEDOUT;
+            return -1;
+        }
+    }
+    o->nconns++;
+    pthread_mutex_unlock(&pool_lock);
+
+    /* Connect in what the wait for a slot left of the time */
+    clock_gettime(CLOCK_REALTIME, &now);
+    left = (until.tv_sec - now.tv_sec) * 1000
+           + (until.tv_nsec - now.tv_nsec) / 1000000;
+    *reused = 0;
+    if ((fd = dns_open_clientfd(hostname, port, left > 0 ? left : 1)) < 0)
+    {
+        err = errno;
+        pthread_mutex_lock(&pool_lock);
+        o->nconns--;
+        pthread_cond_broadcast(&pool_cond);
+        pthread_mutex_unlock(&pool_lock);
+        errno = err;
+    }
+    return fd;
+}
+/*
+ * upstream_release: give back a connection from upstream_get. It is kept
+ *                   for reuse if reusable, else closed.
+ */
+void upstream_release(int fd, char *hostname, char *port, int reusable)
+{
+    origin_t *o;
+    time_t now = time(NULL);
+
+    pthread_mutex_lock(&pool_lock);
+    o = origin_of(hostname, port);
+    if (reusable)
+    {
+        if (o->nidle == UPSTREAM_MAX_IDLE)
+        {
+            drop_idle(o, 0);
+        }
+        o->idle_fd[o->nidle] = fd;
+        o->idle_since[o->nidle] = now;
+        o->nidle++;
+    }
+    else
+    {
+        Close(fd);
+        o->nconns--;
+    }
+    pthread_cond_broadcast(&pool_cond);
+    if (now - last_sweep > UPSTREAM_IDLE_SECS)
+    {
+        sweep(now);
+    }
+    pthread_mutex_unlock(&pool_lock);
+}
@@ -0,0 +1,27 @@
+#ifndef UPSTREAM_H
+#define UPSTREAM_H
+#include "csapp.h"
+
+#define UPSTREAM_MAX_CONNS 16   /* Connections per origin, busy or idle */
+#define UPSTREAM_MAX_IDLE   8   /* Idle connections kept per origin */
+#define UPSTREAM_IDLE_SECS 30   /* Idle connections older than this close */
+#define UPSTREAM_BUCKETS   64
+
+/* Struct for one origin (host, port) and its idle connections */
+typedef struct origin origin_t;
+struct origin
+{
+    char key[MAXLINE];            /* "host:port" */
+    int nconns;                   /* open connections, busy or idle */
+    int nidle;
+    int nwaiters;                 /* callers waiting for a free slot */
+    int idle_fd[UPSTREAM_MAX_IDLE];        /* most recent last */
+    time_t idle_since[UPSTREAM_MAX_IDLE];
+    origin_t *next;
+};
+
+void upstream_init();
+int upstream_get(char *hostname, char *port, int timeout_ms, int *reused);
+void upstream_release(int fd, char *hostname, char *port, int reusable);
+
+#endif